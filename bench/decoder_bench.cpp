@@ -0,0 +1,450 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// Microbenchmarks of the geometry converter and the document decoder used
+// by the featuresets, over synthetic BSON documents. No server needed.
+//
+//     ./bench/decoder_bench [iterations]
+//
+// It also replays one cached batch from two threads at once, walking the
+// geometry the way the renderer does, to check that readers don't share
+// vertex iterators.
+
+// mapnik
+#include <mapnik/feature.hpp>
+#include <mapnik/feature_factory.hpp>
+#include <mapnik/geometry.hpp>
+#include <mapnik/timer.hpp>
+#include <mapnik/well_known_srs.hpp>
+#include <mapnik/vertex.hpp>
+
+// mongo
+#include <mongo/client/dbclient.h>
+
+// boost
+#include <boost/make_shared.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/ref.hpp>
+
+// stl
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+
+#include "mongodb_converter.hpp"
+#include "mongodb_decoder.hpp"
+#include "mongodb_feature_cache.hpp"
+#include "mongodb_cached_featureset.hpp"
+
+// heap allocations made by the whole process, only read around the
+// single-threaded benchmarks
+static size_t allocations = 0;
+
+void *operator new(size_t size) throw(std::bad_alloc) {
+    ++allocations;
+    void *p = std::malloc(size > 0 ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) throw() {
+    std::free(p);
+}
+
+namespace {
+
+mongo::BSONArray make_ring(size_t points, double cx, double cy, double r) {
+    mongo::BSONArrayBuilder ring;
+
+    for (size_t i = 0; i < points; ++i) {
+        double a = 2 * M_PI * i / points;
+        ring.append(BSON_ARRAY(cx + r * std::cos(a) << cy + r * std::sin(a)));
+    }
+    ring.append(BSON_ARRAY(cx + r << cy)); // closed
+
+    return ring.arr();
+}
+
+mongo::BSONObj make_point() {
+    return BSON("type" << "Point" << "coordinates" << BSON_ARRAY(30.5 << 50.45));
+}
+
+mongo::BSONObj make_linestring(size_t points) {
+    mongo::BSONArrayBuilder coords;
+
+    for (size_t i = 0; i < points; ++i)
+        coords.append(BSON_ARRAY(-10.0 + 20.0 * i / points << std::sin(i * 0.01)));
+
+    return BSON("type" << "LineString" << "coordinates" << coords.arr());
+}
+
+mongo::BSONObj make_polygon(size_t rings, size_t points) {
+    mongo::BSONArrayBuilder coords;
+
+    coords.append(make_ring(points, 0, 0, 10));
+    for (size_t r = 1; r < rings; ++r)
+        coords.append(make_ring(points, -5 + 10.0 * r / rings, 0, 0.1));
+
+    return BSON("type" << "Polygon" << "coordinates" << coords.arr());
+}
+
+mongo::BSONObj make_document(const mongo::BSONObj &geometry, int id) {
+    return BSON("_id" << id <<
+                "geometry" << geometry <<
+                "properties" << BSON("name" << "Long Hard Road" <<
+                                     "id" << id <<
+                                     "population" << 32167.5 <<
+                                     "class" << "primary"));
+}
+
+size_t count_vertices(const mapnik::feature_ptr &feature) {
+    size_t n = 0;
+
+    for (unsigned i = 0; i < feature->num_geometries(); ++i)
+        n += feature->get_geometry(i).size();
+
+    return n;
+}
+
+bool same_geometry(const mapnik::feature_ptr &a, const mapnik::feature_ptr &b) {
+    if (a->num_geometries() != b->num_geometries())
+        return false;
+
+    for (unsigned i = 0; i < a->num_geometries(); ++i) {
+        mapnik::geometry_type &ga = a->get_geometry(i);
+        mapnik::geometry_type &gb = b->get_geometry(i);
+
+        if (ga.type() != gb.type() || ga.size() != gb.size())
+            return false;
+
+        for (unsigned v = 0; v < ga.size(); ++v) {
+            double xa, ya, xb, yb;
+
+            if (ga.vertex(v, &xa, &ya) != gb.vertex(v, &xb, &yb) || xa != xb || ya != yb)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void report(const std::string &name, double seconds, size_t iterations, size_t vertices) {
+    std::cout << std::left << std::setw(36) << name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(1) << seconds * 1e9 / iterations << " ns/doc"
+              << std::setw(14) << std::setprecision(1) << vertices / seconds / 1e6 << " Mvertices/s"
+              << std::endl;
+}
+
+bool bench_geometry(const std::string &name, const mongo::BSONObj &geometry, size_t iterations) {
+    mapnik::context_ptr ctx = boost::make_shared<mapnik::context_type>();
+    mongo::BSONObj doc = BSON("geometry" << geometry);
+    mongo::BSONElement loc = doc["geometry"];
+
+    // equivalence with the reference converter
+    mapnik::feature_ptr expected(mapnik::feature_factory::create(ctx, 0));
+    mapnik::feature_ptr actual(mapnik::feature_factory::create(ctx, 0));
+    mongodb_converter::convert_geometry(loc, expected);
+    mongodb_converter::decode_geometry(loc, actual);
+
+    if (!same_geometry(expected, actual)) {
+        std::cerr << name << ": streaming decoder output differs from the reference converter" << std::endl;
+        return false;
+    }
+
+    size_t vertices = count_vertices(expected) * iterations;
+
+    double start = mapnik::time_now();
+    for (size_t i = 0; i < iterations; ++i) {
+        mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx, i));
+        mongodb_converter::convert_geometry(loc, feature);
+    }
+    report(name + " (reference)", mapnik::time_now() - start, iterations, vertices);
+
+    start = mapnik::time_now();
+    for (size_t i = 0; i < iterations; ++i) {
+        mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx, i));
+        mongodb_converter::decode_geometry(loc, feature);
+    }
+    report(name + " (streaming)", mapnik::time_now() - start, iterations, vertices);
+
+    return true;
+}
+
+bool bench_packed(const std::string &name, const mongo::BSONObj &geometry, size_t iterations) {
+    mapnik::context_ptr ctx = boost::make_shared<mapnik::context_type>();
+    mongo::BSONObj doc = BSON("geometry" << geometry);
+
+    std::string packed;
+    if (!mongodb_converter::encode_packed(doc["geometry"], packed)) {
+        std::cerr << name << ": can't encode the geometry" << std::endl;
+        return false;
+    }
+
+    mongo::BSONObjBuilder builder;
+    builder.appendBinData("geometry", packed.size(),
+                          static_cast<mongo::BinDataType>(mongodb_converter::packed_subtype), packed.data());
+    mongo::BSONObj binary = builder.obj();
+    mongo::BSONElement loc = binary["geometry"];
+
+    mapnik::feature_ptr expected(mapnik::feature_factory::create(ctx, 0));
+    mapnik::feature_ptr actual(mapnik::feature_factory::create(ctx, 0));
+    mongodb_converter::convert_geometry(doc["geometry"], expected);
+    mongodb_converter::decode_geometry(loc, actual);
+
+    if (!same_geometry(expected, actual)) {
+        std::cerr << name << ": packed decoder output differs from the reference converter" << std::endl;
+        return false;
+    }
+
+    std::cout << std::left << std::setw(36) << name + " (size)" << std::right
+              << std::setw(12) << doc.objsize() << " bytes BSON"
+              << std::setw(12) << binary.objsize() << " bytes packed" << std::endl;
+
+    size_t vertices = count_vertices(expected) * iterations;
+
+    double start = mapnik::time_now();
+    for (size_t i = 0; i < iterations; ++i) {
+        mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx, i));
+        mongodb_converter::decode_geometry(loc, feature);
+    }
+    report(name + " (packed)", mapnik::time_now() - start, iterations, vertices);
+
+    return true;
+}
+
+// projects every vertex of a lon/lat feature the way mapnik's transform
+// does, one call per vertex
+size_t project_vertices(const mapnik::feature_ptr &feature, std::vector<double> &xy) {
+    xy.clear();
+
+    for (unsigned i = 0; i < feature->num_geometries(); ++i) {
+        mapnik::geometry_type &geom = feature->get_geometry(i);
+
+        for (unsigned v = 0; v < geom.size(); ++v) {
+            double x, y;
+            if (geom.vertex(v, &x, &y) == mapnik::SEG_CLOSE)
+                continue;
+
+            mapnik::lonlat2merc(&x, &y, 1);
+            xy.push_back(x);
+            xy.push_back(y);
+        }
+    }
+
+    return xy.size() / 2;
+}
+
+bool bench_mercator(const std::string &name, const mongo::BSONObj &geometry, size_t iterations) {
+    mapnik::context_ptr ctx = boost::make_shared<mapnik::context_type>();
+    mongo::BSONObj doc = BSON("geometry" << geometry);
+    mongo::BSONElement loc = doc["geometry"];
+    std::vector<double> scratch, expected;
+
+    mapnik::feature_ptr lonlat(mapnik::feature_factory::create(ctx, 0));
+    mapnik::feature_ptr projected(mapnik::feature_factory::create(ctx, 0));
+    mongodb_converter::decode_geometry(loc, lonlat);
+    mongodb_converter::decode_geometry(loc, projected, 0.0, &scratch);
+    project_vertices(lonlat, expected);
+
+    size_t n = 0;
+    for (unsigned i = 0; i < projected->num_geometries(); ++i) {
+        mapnik::geometry_type &geom = projected->get_geometry(i);
+
+        for (unsigned v = 0; v < geom.size(); ++v) {
+            double x, y;
+            if (geom.vertex(v, &x, &y) == mapnik::SEG_CLOSE)
+                continue;
+
+            if (2 * n + 1 >= expected.size() ||
+                std::fabs(x - expected[2 * n]) > 1e-3 || std::fabs(y - expected[2 * n + 1]) > 1e-3) {
+                std::cerr << name << ": mercator decoder output differs from mapnik's projection" << std::endl;
+                return false;
+            }
+            ++n;
+        }
+    }
+
+    size_t vertices = count_vertices(lonlat) * iterations;
+
+    double start = mapnik::time_now();
+    for (size_t i = 0; i < iterations; ++i) {
+        mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx, i));
+        mongodb_converter::decode_geometry(loc, feature);
+        project_vertices(feature, expected);
+    }
+    report(name + " (per vertex)", mapnik::time_now() - start, iterations, vertices);
+
+    start = mapnik::time_now();
+    for (size_t i = 0; i < iterations; ++i) {
+        mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx, i));
+        mongodb_converter::decode_geometry(loc, feature, 0.0, &scratch);
+    }
+    report(name + " (mercator)", mapnik::time_now() - start, iterations, vertices);
+
+    return true;
+}
+
+void bench_decoder(const std::string &name, const mongo::BSONObj &geometry, size_t iterations, bool arena) {
+    mapnik::context_ptr ctx = boost::make_shared<mapnik::context_type>();
+    ctx->push("name");
+    ctx->push("population");
+
+    mongodb_decoder::options opts;
+    opts.extend_context = false;
+    opts.arena = arena;
+    mongodb_decoder decoder(ctx, "utf-8", opts);
+
+    std::vector<mongo::BSONObj> docs;
+    for (int i = 0; i < 64; ++i)
+        docs.push_back(make_document(geometry, i));
+
+    query_stats stats;
+    size_t allocated = allocations;
+    double start = mapnik::time_now();
+    for (size_t i = 0; i < iterations; ++i)
+        decoder.decode(docs[i % docs.size()], i, stats);
+    double seconds = mapnik::time_now() - start;
+    allocated = allocations - allocated;
+
+    report(name + (arena ? " (document, arena)" : " (document, heap)"), seconds, iterations, stats.vertices);
+    std::cout << std::left << std::setw(36) << "" << std::right
+              << std::setw(12) << std::setprecision(2) << static_cast<double>(allocated) / iterations
+              << " allocs/doc" << std::endl;
+}
+
+// sums every vertex the way a renderer reads them, through rewind()/vertex()
+double walk(const mapnik::feature_ptr &feature) {
+    double sum = 0, x, y;
+
+    for (unsigned i = 0; i < feature->num_geometries(); ++i) {
+        mapnik::geometry_type &geom = feature->get_geometry(i);
+        unsigned cmd;
+
+        geom.rewind(0);
+        while ((cmd = geom.vertex(&x, &y)) != mapnik::SEG_END)
+            if (cmd != mapnik::SEG_CLOSE)
+                sum += x + y;
+    }
+
+    return sum;
+}
+
+struct replay {
+    std::string key;
+    size_t rounds;
+    double expected;
+    bool ok;
+
+    replay(const std::string &k, size_t r, double e) : key(k), rounds(r), expected(e), ok(true) {}
+
+    void operator()() {
+        for (size_t r = 0; r < rounds && ok; ++r) {
+            mongodb_feature_cache::batch_ptr batch = mongodb_feature_cache::instance().find(key);
+            if (!batch) {
+                ok = false;
+                break;
+            }
+
+            mongodb_memory_featureset fs(batch);
+            double sum = 0;
+            for (mapnik::feature_ptr feature = fs.next(); feature; feature = fs.next())
+                sum += walk(feature);
+
+            ok = sum == expected;
+        }
+    }
+};
+
+bool bench_cache_replay(const std::string &name, const mongo::BSONObj &geometry, size_t rounds) {
+    mapnik::context_ptr ctx = boost::make_shared<mapnik::context_type>();
+    ctx->push("name");
+    ctx->push("population");
+
+    mongodb_decoder::options opts;
+    opts.extend_context = false;
+    opts.arena = false;
+    mongodb_decoder decoder(ctx, "utf-8", opts);
+
+    boost::shared_ptr<mongodb_feature_cache::batch_type> batch = boost::make_shared<mongodb_feature_cache::batch_type>();
+    size_t bytes = 0, vertices = 0;
+    double expected = 0;
+    for (int i = 0; i < 64; ++i) {
+        mapnik::feature_ptr feature = decoder.decode(make_document(geometry, i), i);
+        expected += walk(feature);
+        bytes += mongodb_feature_cache::estimate_size(feature);
+        vertices += count_vertices(feature);
+        batch->push_back(feature);
+    }
+
+    std::string key = "decoder_bench " + name;
+    mongodb_feature_cache::instance().reserve(bytes * 2);
+    mongodb_feature_cache::instance().insert(key, batch, bytes, 0);
+
+    replay first(key, rounds, expected), second(key, rounds, expected);
+    double start = mapnik::time_now();
+    boost::thread a(boost::ref(first)), b(boost::ref(second));
+    a.join();
+    b.join();
+    double seconds = mapnik::time_now() - start;
+
+    if (!first.ok || !second.ok) {
+        std::cerr << name << ": concurrent replays of a cached batch read different geometry" << std::endl;
+        return false;
+    }
+
+    report(name + " (cached, 2 threads)", seconds, 2 * rounds * batch->size(), 2 * rounds * vertices);
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    size_t iterations = argc > 1 ? std::strtoul(argv[1], 0, 10) : 20000;
+    bool ok = true;
+
+    ok &= bench_geometry("point", make_point(), iterations * 10);
+    ok &= bench_geometry("linestring 1000", make_linestring(1000), iterations / 10);
+    ok &= bench_geometry("polygon 20x500", make_polygon(20, 500), iterations / 10);
+
+    ok &= bench_packed("point", make_point(), iterations * 10);
+    ok &= bench_packed("linestring 1000", make_linestring(1000), iterations / 10);
+    ok &= bench_packed("polygon 20x500", make_polygon(20, 500), iterations / 10);
+
+    ok &= bench_mercator("linestring 1000", make_linestring(1000), iterations / 10);
+    ok &= bench_mercator("polygon 20x500", make_polygon(20, 500), iterations / 10);
+
+    for (int arena = 0; arena < 2; ++arena) {
+        bench_decoder("point", make_point(), iterations * 10, arena);
+        bench_decoder("linestring 1000", make_linestring(1000), iterations / 10, arena);
+        bench_decoder("polygon 20x500", make_polygon(20, 500), iterations / 10, arena);
+    }
+
+    ok &= bench_cache_replay("polygon 20x500", make_polygon(20, 500), iterations / 1000 + 1);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,118 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// End-to-end benchmark: renders a tile pyramid of a map through the
+// mongodb plugin and reports throughput, latency percentiles and peak RSS.
+// Expects a running mongod loaded with test/shp (see README).
+//
+//     ./bench/render_bench [map.xml] [plugin dir] [max zoom] [tile size] [fonts dir]
+
+// mapnik
+#include <mapnik/map.hpp>
+#include <mapnik/load_map.hpp>
+#include <mapnik/datasource_cache.hpp>
+#include <mapnik/font_engine_freetype.hpp>
+#include <mapnik/agg_renderer.hpp>
+#include <mapnik/graphics.hpp>
+#include <mapnik/box2d.hpp>
+#include <mapnik/timer.hpp>
+
+// stl
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+
+// posix
+#include <sys/resource.h>
+
+namespace {
+
+double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+}
+
+int main(int argc, char **argv) {
+    std::string map_file = argc > 1 ? argv[1] : "test/test.xml";
+    std::string plugins = argc > 2 ? argv[2] : ".";
+    int max_zoom = argc > 3 ? std::atoi(argv[3]) : 4;
+    unsigned tile_size = argc > 4 ? std::atoi(argv[4]) : 256;
+
+    try {
+        mapnik::datasource_cache::instance().register_datasources(plugins);
+        if (argc > 5)
+            mapnik::freetype_engine::register_fonts(argv[5], true);
+
+        mapnik::Map map(tile_size, tile_size);
+        mapnik::load_map(map, map_file);
+
+        // the test map is in geographic coordinates: 2 x 1 tiles at zoom 0
+        const mapnik::box2d<double> world(-180, -90, 180, 90);
+        std::vector<double> latencies;
+
+        double start = mapnik::time_now();
+        for (int z = 0; z <= max_zoom; ++z) {
+            int rows = 1 << z, cols = 2 << z;
+            double step = world.height() / rows;
+
+            for (int y = 0; y < rows; ++y)
+                for (int x = 0; x < cols; ++x) {
+                    mapnik::box2d<double> tile(world.minx() + x * step, world.miny() + y * step,
+                                               world.minx() + (x + 1) * step, world.miny() + (y + 1) * step);
+                    mapnik::image_32 image(tile_size, tile_size);
+
+                    double tile_start = mapnik::time_now();
+                    map.zoom_to_box(tile);
+                    mapnik::agg_renderer<mapnik::image_32> renderer(map, image);
+                    renderer.apply();
+                    latencies.push_back((mapnik::time_now() - tile_start) * 1000.0);
+                }
+        }
+        double elapsed = mapnik::time_now() - start;
+
+        std::sort(latencies.begin(), latencies.end());
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << "tiles:     " << latencies.size() << " (zoom 0-" << max_zoom << ", " << tile_size << "px)\n"
+                  << "tiles/s:   " << latencies.size() / elapsed << "\n"
+                  << "p50:       " << percentile(latencies, 0.50) << " ms\n"
+                  << "p99:       " << percentile(latencies, 0.99) << " ms\n"
+                  << "peak RSS:  " << usage.ru_maxrss / 1024.0 << " MB" << std::endl;
+    } catch (std::exception const &e) {
+        std::cerr << "render_bench: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
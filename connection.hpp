@@ -32,6 +32,8 @@
 // boost
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/optional.hpp>
 
 // std
 #include <sstream>
@@ -41,10 +43,38 @@ class Connection {
     boost::scoped_ptr<mongo::ScopedDbConnection> conn_;
     std::string ns_;
     bool closed_;
+    boost::optional<mongo::ReadPreference> read_preference_;
+
+    static boost::optional<mongo::ReadPreference> parse_read_preference(const std::string &name) {
+        if (name.empty() || name == "primary")
+            return boost::optional<mongo::ReadPreference>();
+        if (name == "primaryPreferred")
+            return mongo::ReadPreference_PrimaryPreferred;
+        if (name == "secondary")
+            return mongo::ReadPreference_SecondaryOnly;
+        if (name == "secondaryPreferred")
+            return mongo::ReadPreference_SecondaryPreferred;
+        if (name == "nearest")
+            return mongo::ReadPreference_Nearest;
+
+        throw mapnik::datasource_exception("Mongodb Plugin: unknown read preference '" + name + "'\n");
+    }
+
+    // reads routed by the read preference, primary only by default
+    mongo::Query route(mongo::Query query) const {
+        if (read_preference_)
+            query.readPref(*read_preference_, mongo::BSONArray());
+
+        return query;
+    }
+
+    int query_options() const {
+        return read_preference_ ? mongo::QueryOption_SlaveOk : 0;
+    }
 
 public:
-    Connection(const std::string &connection_str, const std::string ns)
-        : ns_(ns), closed_(false) {
+    Connection(const std::string &connection_str, const std::string ns, const std::string &read_preference = "")
+        : ns_(ns), closed_(false), read_preference_(parse_read_preference(read_preference)) {
         try {
             conn_.reset(mongo::ScopedDbConnection::getScopedDbConnection(connection_str));
         } catch (mongo::DBException &de) {
@@ -59,14 +89,113 @@ public:
         close();
     }
 
-    boost::shared_ptr<mongo::DBClientCursor> query(const std::string &json, int limit = 0, int skip = 0) {
+    // The server sorts in memory when no index provides the order and gives
+    // up past 32MB: 10128 on 2.4, 17144 on 2.6 (16819/16820 from the 2.4
+    // sort of queries with a limit).
+    static bool sort_overflow(const mongo::DBException &de) {
+        int code = de.getCode();
+        return code == 10128 || code == 16819 || code == 16820 || code == 17144;
+    }
+
+    static std::string error_message(const mongo::DBException &de) {
+        if (sort_overflow(de))
+            return "Mongodb Plugin: the server ran out of memory sorting by thin_priority, "
+                   "create a compound index leading with the attribute (" + de.toString() + ")\n";
+
+        return "Mongodb Plugin: " + de.toString() + "\n";
+    }
+
+    // json is either a plain query or one already wrapped in "$query"
+    // along with modifiers such as "$orderby"
+    static mongo::Query make_query(const std::string &json, int max_time_ms) {
+        if (max_time_ms <= 0)
+            return mongo::Query(json);
+
+        mongo::BSONObj parsed = mongo::fromjson(json);
+        mongo::BSONObjBuilder query;
+        if (parsed.hasField("$query"))
+            query.appendElements(parsed);
+        else
+            query.append("$query", parsed);
+        query.append("$maxTimeMS", max_time_ms);
+        return mongo::Query(query.obj());
+    }
+
+    boost::shared_ptr<mongo::DBClientCursor> query(const std::string &json, const mongo::BSONObj &fields = mongo::BSONObj(),
+                                                   int limit = 0, int skip = 0, int batch_size = 0, int max_time_ms = 0) {
         try {
-            mongo::DBClientCursor *ptr = conn_->get()->query(ns_, mongo::Query(json), limit, skip).release();
+            const mongo::BSONObj *fields_ptr = fields.isEmpty() ? 0 : &fields;
+            mongo::DBClientCursor *ptr = conn_->get()->query(ns_, route(make_query(json, max_time_ms)), limit, skip,
+                                                             fields_ptr, query_options(), batch_size).release();
 
             if (!ptr)
                 throw conn_->get()->getLastError();
 
             return boost::shared_ptr<mongo::DBClientCursor>(ptr);
+        } catch(mongo::DBException &de) {
+            throw mapnik::datasource_exception(error_message(de));
+        }
+    }
+
+    // Streams the whole result with the server pushing batches back to back
+    // (exhaust mode), calling f for every batch. Blocks until the stream
+    // ends; an exception thrown by f aborts it and leaves the connection
+    // unusable, so callers must discard() it.
+    void exhaust(const std::string &json, const mongo::BSONObj &fields, int max_time_ms,
+                 boost::function<void(mongo::DBClientCursorBatchIterator &)> f) {
+        try {
+            const mongo::BSONObj *fields_ptr = fields.isEmpty() ? 0 : &fields;
+            conn_->get()->query(f, ns_, route(make_query(json, max_time_ms)), fields_ptr, query_options());
+        } catch(mongo::DBException &de) {
+            throw mapnik::datasource_exception(error_message(de));
+        }
+    }
+
+    // Runs an aggregation pipeline given as a JSON array and returns the
+    // array of result documents. The 2.4 protocol has no aggregation
+    // cursor, so the result is returned inline and limited to 16MB.
+    mongo::BSONObj aggregate(const std::string &pipeline, int max_time_ms = 0) {
+        mongo::BSONObj info;
+
+        try {
+            mongo::BSONObj parsed = mongo::fromjson("{ \"pipeline\": " + pipeline + " }");
+
+            mongo::BSONObjBuilder cmd;
+            cmd.append("aggregate", collection());
+            cmd.append(parsed["pipeline"]);
+            if (max_time_ms > 0)
+                cmd.append("maxTimeMS", max_time_ms);
+
+            if (!conn_->get()->runCommand(database(), cmd.obj(), info, query_options()))
+                throw mapnik::datasource_exception("Mongodb Plugin: aggregation failed: " + info["errmsg"].str() + "\n");
+        } catch(mongo::DBException &de) {
+            std::string err_msg = "Mongodb Plugin: ";
+            err_msg += de.toString();
+            err_msg += "\n";
+            throw mapnik::datasource_exception(err_msg);
+        }
+
+        mongo::BSONElement result = info["result"];
+        if (result.type() != mongo::Array)
+            return mongo::BSONObj();
+
+        return result.embeddedObject().getOwned();
+    }
+
+    mongo::BSONObj findOne(const std::string &ns, const mongo::BSONObj &query) {
+        try {
+            return conn_->get()->findOne(ns, mongo::Query(query));
+        } catch(mongo::DBException &de) {
+            std::string err_msg = "Mongodb Plugin: ";
+            err_msg += de.toString();
+            err_msg += "\n";
+            throw mapnik::datasource_exception(err_msg);
+        }
+    }
+
+    void upsert(const std::string &ns, const mongo::BSONObj &query, const mongo::BSONObj &obj) {
+        try {
+            conn_->get()->update(ns, mongo::Query(query), obj, true);
         } catch(mongo::DBException &de) {
             std::string err_msg = "Mongodb Plugin: ";
             err_msg += de.toString();
@@ -75,10 +204,39 @@ public:
         }
     }
 
+    const std::string &ns() const {
+        return ns_;
+    }
+
+    std::string database() const {
+        return ns_.substr(0, ns_.find('.'));
+    }
+
+    std::string collection() const {
+        return ns_.substr(ns_.find('.') + 1);
+    }
+
     bool isOK() const {
         return (!closed_) && (conn_->ok());
     }
 
+    bool ping() {
+        try {
+            mongo::BSONObj info;
+            return conn_->get()->runCommand("admin", BSON("ping" << 1), info);
+        } catch(mongo::DBException &) {
+            return false;
+        }
+    }
+
+    // drops a connection left in an undefined state instead of returning it to the driver pool
+    void discard() {
+        if (!closed_) {
+            conn_->kill();
+            closed_ = true;
+        }
+    }
+
     void close() {
         if (!closed_) {
             conn_->done();
@@ -27,27 +27,38 @@
 #include "connection.hpp"
 
 // mapnik
-#include <mapnik/pool.hpp>
+#include <mapnik/debug.hpp>
 #include <mapnik/utils.hpp>
 
 // boost
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/optional.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
 // stl
 #include <string>
 #include <sstream>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <algorithm>
 
-using mapnik::Pool;
 using mapnik::singleton;
 using mapnik::CreateStatic;
 
+// host may be a comma separated seed list; members without a port get
+// the port given. With a replica set name the connection string takes
+// the "name/seed,seed" form the driver turns into a replica set client.
 template <typename T>
 class ConnectionCreator {
     boost::optional<std::string> host_, port_;
     boost::optional<std::string> dbname_, collection_;
     boost::optional<std::string> user_, pass_;
+    boost::optional<std::string> replica_set_, read_preference_;
 
 public:
     ConnectionCreator(const boost::optional<std::string> &host,
@@ -55,56 +66,324 @@ public:
                       const boost::optional<std::string> &dbname,
                       const boost::optional<std::string> &collection,
                       const boost::optional<std::string> &user,
-                      const boost::optional<std::string> &pass)
+                      const boost::optional<std::string> &pass,
+                      const boost::optional<std::string> &replica_set = boost::optional<std::string>(),
+                      const boost::optional<std::string> &read_preference = boost::optional<std::string>())
         : host_(host), port_(port),
           dbname_(dbname), collection_(collection),
-          user_(user), pass_(pass) {}
+          user_(user), pass_(pass),
+          replica_set_(replica_set), read_preference_(read_preference) {}
 
     T* operator()() const {
-        return new T(connection_string(), namespace_string());
+        return new T(connection_string(), namespace_string(), read_preference());
     }
 
+    // connections differing in read preference can't share a pool
     inline std::string id() const {
-        return connection_string() + " " + namespace_string();
+        std::string key = connection_string() + " " + namespace_string();
+
+        if (!read_preference().empty())
+            key += " " + read_preference();
+
+        return key;
     }
 
     inline std::string connection_string() const {
-        std::string rs = *host_;
+        std::string rs;
+
+        if (replica_set_ && !replica_set_->empty())
+            rs = *replica_set_ + "/";
+
+        std::string::size_type begin = 0;
+        while (begin <= host_->size()) {
+            std::string::size_type end = host_->find(',', begin);
+            if (end == std::string::npos)
+                end = host_->size();
+
+            std::string member = host_->substr(begin, end - begin);
+            if (!member.empty()) {
+                if (rs.size() > 0 && rs[rs.size() - 1] != '/')
+                    rs += ",";
+                rs += member;
 
-        if (port_ && !port_->empty())
-            rs += ":" + *port_;
+                if (member.find(':') == std::string::npos && port_ && !port_->empty())
+                    rs += ":" + *port_;
+            }
+
+            begin = end + 1;
+        }
 
         return rs;
     }
 
+    inline std::string read_preference() const {
+        return read_preference_ ? *read_preference_ : std::string();
+    }
+
     inline std::string namespace_string() const {
         return *dbname_ + "." + *collection_;
     }
 };
 
+// Connection pool safe for concurrent use. Every thread remembers the
+// connection it used last and gets it back without touching the shared
+// lock as long as nobody else holds it; only misses scan the pool. The
+// shared lock only guards the slot list: pings and connects run outside
+// it, so a slow server stalls the borrower waiting on it and nobody else.
+class ConnectionPool : private boost::noncopyable {
+    struct Slot {
+        boost::shared_ptr<Connection> conn;
+        boost::mutex guard; // protects busy and last_used
+        bool busy;
+        std::time_t last_used;
+
+        Slot() : busy(false), last_used(0) {}
+    };
+    typedef boost::shared_ptr<Slot> SlotPtr;
+
+    // returns the slot to the pool when the last copy of a borrowed connection goes away
+    struct Lease {
+        SlotPtr slot;
+
+        explicit Lease(const SlotPtr &s) : slot(s) {}
+        ~Lease() {
+            release(slot, true);
+        }
+    };
+
+    ConnectionCreator<Connection> creator_;
+    size_t initial_size_;
+    size_t max_size_;
+    const int health_check_interval_; // fixed at construction, read without a lock
+    std::vector<SlotPtr> slots_;
+    boost::mutex mutex_;
+    boost::thread_specific_ptr<boost::weak_ptr<Slot> > affinity_;
+
+    static bool tryAcquire(const SlotPtr &slot) {
+        boost::mutex::scoped_lock lock(slot->guard);
+
+        if (slot->busy)
+            return false;
+
+        slot->busy = true;
+        return true;
+    }
+
+    static void release(const SlotPtr &slot, bool used) {
+        boost::mutex::scoped_lock lock(slot->guard);
+
+        if (used)
+            slot->last_used = std::time(0);
+        slot->busy = false;
+    }
+
+    static std::time_t idle_since(const SlotPtr &slot) {
+        boost::mutex::scoped_lock lock(slot->guard);
+        return slot->last_used;
+    }
+
+    // called with the slot acquired
+    bool healthy(const SlotPtr &slot) {
+        if (!slot->conn || !slot->conn->isOK())
+            return false;
+
+        if (health_check_interval_ > 0 && std::time(0) - idle_since(slot) >= health_check_interval_)
+            return slot->conn->ping();
+
+        return true;
+    }
+
+    boost::shared_ptr<Connection> lease(const SlotPtr &slot) {
+        if (!affinity_.get())
+            affinity_.reset(new boost::weak_ptr<Slot>());
+        *affinity_ = slot;
+
+        return boost::shared_ptr<Connection>(boost::make_shared<Lease>(slot), slot->conn.get());
+    }
+
+    // called with the slot acquired and without the pool lock, reconnects
+    // a dead connection in place
+    bool revive(const SlotPtr &slot) {
+        if (healthy(slot))
+            return true;
+
+        if (slot->conn)
+            slot->conn->discard();
+
+        try {
+            slot->conn.reset(creator_());
+            return slot->conn->isOK();
+        } catch (mapnik::datasource_exception &e) {
+            MAPNIK_LOG_WARN(mongodb) << "mongodb_datasource: reconnecting failed: " << e.what();
+            return false;
+        }
+    }
+
+    // acquires a free slot not tried yet, or reserves room for a new one
+    SlotPtr claim(const std::vector<SlotPtr> &tried, bool &opened) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        for (std::vector<SlotPtr>::const_iterator itr = slots_.begin(); itr != slots_.end(); ++itr)
+            if (std::find(tried.begin(), tried.end(), *itr) == tried.end() && tryAcquire(*itr))
+                return *itr;
+
+        if (opened || slots_.size() >= max_size_)
+            return SlotPtr();
+
+        // counted against max_size right away, connected by the caller
+        SlotPtr slot = boost::make_shared<Slot>();
+        slot->busy = true;
+        slots_.push_back(slot);
+        opened = true;
+        return slot;
+    }
+
+    void remove(const SlotPtr &slot) {
+        boost::mutex::scoped_lock lock(mutex_);
+        slots_.erase(std::remove(slots_.begin(), slots_.end(), slot), slots_.end());
+    }
+
+public:
+    // healthCheckInterval is the number of seconds a connection may sit idle
+    // before it is pinged on borrow, 0 disables pings
+    ConnectionPool(const ConnectionCreator<Connection> &creator, size_t initialSize, size_t maxSize,
+                   int healthCheckInterval = 30)
+        : creator_(creator), initial_size_(initialSize), max_size_(maxSize),
+          health_check_interval_(healthCheckInterval) {
+        warmUp();
+    }
+
+    const ConnectionCreator<Connection> &creator() const {
+        return creator_;
+    }
+
+    std::string id() const {
+        return creator_.id();
+    }
+
+    size_t max_size() {
+        boost::mutex::scoped_lock lock(mutex_);
+        return max_size_;
+    }
+
+    void set_initial_size(size_t size) {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            initial_size_ = size;
+        }
+
+        warmUp();
+    }
+
+    void set_max_size(size_t size) {
+        boost::mutex::scoped_lock lock(mutex_);
+        max_size_ = size;
+    }
+
+    // opens connections up to the initial size, connecting outside the lock
+    void warmUp() {
+        size_t missing = 0;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            size_t target = std::min(initial_size_, max_size_);
+            if (slots_.size() < target)
+                missing = target - slots_.size();
+        }
+
+        std::vector<SlotPtr> opened;
+        while (opened.size() < missing) {
+            SlotPtr slot = boost::make_shared<Slot>();
+
+            try {
+                slot->conn.reset(creator_());
+            } catch (mapnik::datasource_exception &e) {
+                MAPNIK_LOG_WARN(mongodb) << "mongodb_datasource: warming up the pool failed: " << e.what();
+                break;
+            }
+
+            slot->last_used = std::time(0);
+            opened.push_back(slot);
+        }
+
+        // borrowers may have grown the pool meanwhile
+        boost::mutex::scoped_lock lock(mutex_);
+        for (std::vector<SlotPtr>::const_iterator itr = opened.begin(); itr != opened.end(); ++itr)
+            if (slots_.size() < max_size_)
+                slots_.push_back(*itr);
+    }
+
+    boost::shared_ptr<Connection> borrowObject() {
+        std::vector<SlotPtr> tried;
+
+        // fast path: the connection this thread used last, no shared lock
+        if (boost::weak_ptr<Slot> *last = affinity_.get()) {
+            SlotPtr slot = last->lock();
+
+            if (slot && tryAcquire(slot)) {
+                if (revive(slot))
+                    return lease(slot);
+                release(slot, false);
+                tried.push_back(slot);
+            }
+        }
+
+        // every slot is checked at most once, and at most one is opened
+        bool opened = false;
+        while (SlotPtr slot = claim(tried, opened)) {
+            bool fresh = !slot->conn;
+
+            if (revive(slot))
+                return lease(slot);
+
+            if (fresh)
+                remove(slot);
+            else {
+                release(slot, false);
+                tried.push_back(slot);
+            }
+        }
+
+        return boost::shared_ptr<Connection>();
+    }
+};
+
 class ConnectionManager : public singleton <ConnectionManager,CreateStatic> {
     friend class CreateStatic<ConnectionManager>;
-    typedef Pool<Connection, ConnectionCreator> PoolType;
+    typedef ConnectionPool PoolType;
     typedef std::map<std::string, boost::shared_ptr<PoolType> > ContType;
-    typedef boost::shared_ptr<Connection> HolderType;
     ContType pools_;
+    boost::mutex mutex_;
 
 public:
-    bool registerPool(const ConnectionCreator<Connection> &creator, size_t initialSize, size_t maxSize) {
-        ContType::const_iterator itr = pools_.find(creator.id());
+    // the health check interval of whichever datasource created the pool wins
+    boost::shared_ptr<PoolType> registerPool(const ConnectionCreator<Connection> &creator, size_t initialSize, size_t maxSize,
+                                             int healthCheckInterval = 30) {
+        boost::shared_ptr<PoolType> pool;
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            ContType::const_iterator itr = pools_.find(creator.id());
+
+            if (itr != pools_.end()) {
+                itr->second->set_max_size(maxSize);
+                pool = itr->second;
+            }
+        }
 
-        if (itr != pools_.end()) {
-            itr->second->set_initial_size(initialSize);
-            itr->second->set_max_size(maxSize);
-        } else
-            return pools_.insert(
-                std::make_pair(creator.id(), boost::make_shared<PoolType>(creator, initialSize,maxSize))).second;
+        if (pool) {
+            pool->set_initial_size(initialSize);
+            return pool;
+        }
 
-        return false;
+        // connect outside the lock, another thread may register the same pool meanwhile
+        pool = boost::make_shared<PoolType>(creator, initialSize, maxSize, healthCheckInterval);
 
+        boost::mutex::scoped_lock lock(mutex_);
+        return pools_.insert(std::make_pair(creator.id(), pool)).first->second;
     }
 
     boost::shared_ptr<PoolType> getPool(std::string const& key) {
+        boost::mutex::scoped_lock lock(mutex_);
         ContType::const_iterator itr = pools_.find(key);
 
         if (itr != pools_.end())
@@ -0,0 +1,163 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_ARENA_HPP
+#define MONGODB_ARENA_HPP
+
+// boost
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+// stl
+#include <vector>
+#include <algorithm>
+#include <new>
+#include <cstddef>
+
+// Pool of same-sized chunks carved from large blocks, recycled through a
+// free list. The first allocation fixes the chunk size, other sizes fall
+// back to the heap. Blocks are released together when the arena goes.
+class mongodb_arena : private boost::noncopyable {
+    static const size_t alignment = 16;
+
+    size_t chunk_size_;
+    size_t chunks_per_block_;
+    std::vector<char *> blocks_;
+    void *free_;
+    boost::mutex mutex_; // chunks may be freed by another thread
+
+public:
+    explicit mongodb_arena(size_t chunks_per_block = 256)
+        : chunk_size_(0), chunks_per_block_(chunks_per_block > 0 ? chunks_per_block : 1), free_(0) {}
+
+    ~mongodb_arena() {
+        for (std::vector<char *>::const_iterator itr = blocks_.begin(); itr != blocks_.end(); ++itr)
+            ::operator delete(*itr);
+    }
+
+    void *allocate(size_t size) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (chunk_size_ == 0)
+            chunk_size_ = (std::max(size, sizeof(void *)) + alignment - 1) / alignment * alignment;
+
+        if (size > chunk_size_ || chunk_size_ - size >= alignment)
+            return ::operator new(size);
+
+        if (!free_) {
+            char *block = static_cast<char *>(::operator new(chunk_size_ * chunks_per_block_));
+            blocks_.push_back(block);
+
+            for (size_t i = chunks_per_block_; i-- > 0; ) {
+                *reinterpret_cast<void **>(block + i * chunk_size_) = free_;
+                free_ = block + i * chunk_size_;
+            }
+        }
+
+        void *chunk = free_;
+        free_ = *static_cast<void **>(chunk);
+        return chunk;
+    }
+
+    void deallocate(void *p, size_t size) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (size > chunk_size_ || chunk_size_ - size >= alignment) {
+            ::operator delete(p);
+            return;
+        }
+
+        *static_cast<void **>(p) = free_;
+        free_ = p;
+    }
+};
+
+typedef boost::shared_ptr<mongodb_arena> mongodb_arena_ptr;
+
+// Allocator over a shared arena, for boost::allocate_shared. Every copy,
+// including the one kept in a shared_ptr control block, holds the arena,
+// so features outliving their featureset (e.g. in the feature cache)
+// keep their memory valid.
+template <typename T>
+class arena_allocator {
+    template <typename U> friend class arena_allocator;
+
+    mongodb_arena_ptr arena_;
+
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef arena_allocator<U> other;
+    };
+
+    explicit arena_allocator(const mongodb_arena_ptr &arena)
+        : arena_(arena) {}
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U> &other)
+        : arena_(other.arena_) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void * = 0) {
+        return static_cast<pointer>(arena_->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type n) {
+        arena_->deallocate(p, n * sizeof(T));
+    }
+
+    size_type max_size() const {
+        return size_type(-1) / sizeof(T);
+    }
+
+    void construct(pointer p, const T &value) {
+        new (p) T(value);
+    }
+
+    void destroy(pointer p) {
+        p->~T();
+    }
+
+    template <typename U>
+    bool operator==(const arena_allocator<U> &other) const {
+        return arena_ == other.arena_;
+    }
+
+    template <typename U>
+    bool operator!=(const arena_allocator<U> &other) const {
+        return arena_ != other.arena_;
+    }
+};
+
+#endif // MONGODB_ARENA_HPP
@@ -0,0 +1,80 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// boost
+#include <boost/make_shared.hpp>
+
+#include "mongodb_cached_featureset.hpp"
+
+mongodb_memory_featureset::mongodb_memory_featureset(const mongodb_feature_cache::batch_ptr &batch)
+    : batch_(batch),
+      pos_(0) {
+}
+
+mongodb_memory_featureset::~mongodb_memory_featureset() {
+}
+
+feature_ptr mongodb_memory_featureset::next() {
+    // the batch is shared with every other reader of the key
+    if (pos_ < batch_->size())
+        return mongodb_feature_cache::copy((*batch_)[pos_++]);
+
+    return feature_ptr();
+}
+
+mongodb_recording_featureset::mongodb_recording_featureset(const featureset_ptr &source,
+                                                           const std::string &key,
+                                                           std::time_t ttl,
+                                                           size_t max_bytes)
+    : source_(source),
+      key_(key),
+      ttl_(ttl),
+      batch_(boost::make_shared<mongodb_feature_cache::batch_type>()),
+      bytes_(0),
+      max_bytes_(max_bytes) {
+}
+
+mongodb_recording_featureset::~mongodb_recording_featureset() {
+}
+
+feature_ptr mongodb_recording_featureset::next() {
+    feature_ptr feature = source_->next();
+
+    if (!batch_)
+        return feature;
+
+    if (feature) {
+        bytes_ += mongodb_feature_cache::estimate_size(feature);
+
+        // too big to ever fit, stop recording
+        if (bytes_ > max_bytes_)
+            batch_.reset();
+        else
+            batch_->push_back(mongodb_feature_cache::copy(feature)); // feature itself goes to the renderer
+    } else {
+        mongodb_feature_cache::instance().insert(key_, batch_, bytes_, ttl_);
+        batch_.reset();
+    }
+
+    return feature;
+}
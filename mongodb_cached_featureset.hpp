@@ -0,0 +1,76 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_CACHED_FEATURESET_HPP
+#define MONGODB_CACHED_FEATURESET_HPP
+
+// mapnik
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature.hpp>
+
+// boost
+#include <boost/shared_ptr.hpp>
+
+// stl
+#include <string>
+#include <ctime>
+
+#include "mongodb_feature_cache.hpp"
+
+using mapnik::featureset_ptr;
+using mapnik::feature_ptr;
+
+// Replays a batch of features served from the cache, each reader getting
+// copies of its own.
+class mongodb_memory_featureset : public mapnik::Featureset {
+    mongodb_feature_cache::batch_ptr batch_;
+    size_t pos_;
+
+public:
+    mongodb_memory_featureset(const mongodb_feature_cache::batch_ptr &batch);
+    ~mongodb_memory_featureset();
+
+    feature_ptr next();
+};
+
+// Passes features through from a live featureset and stores the batch in
+// the cache once it has been read to the end.
+class mongodb_recording_featureset : public mapnik::Featureset {
+    featureset_ptr source_;
+    std::string key_;
+    std::time_t ttl_;
+    boost::shared_ptr<mongodb_feature_cache::batch_type> batch_;
+    size_t bytes_;
+    size_t max_bytes_;
+
+public:
+    mongodb_recording_featureset(const featureset_ptr &source,
+                                 const std::string &key,
+                                 std::time_t ttl,
+                                 size_t max_bytes);
+    ~mongodb_recording_featureset();
+
+    feature_ptr next();
+};
+
+#endif // MONGODB_CACHED_FEATURESET_HPP
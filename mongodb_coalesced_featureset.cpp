@@ -0,0 +1,148 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// mapnik
+#include <mapnik/datasource.hpp>
+
+// boost
+#include <boost/make_shared.hpp>
+
+#include "mongodb_coalesced_featureset.hpp"
+#include "mongodb_feature_cache.hpp"
+
+mongodb_flight::mongodb_flight(const std::string &key)
+    : key_(key),
+      started_(false),
+      done_(false) {
+}
+
+mongodb_flight::~mongodb_flight() {
+    mongodb_flight_registry::instance().remove(key_, this);
+}
+
+void mongodb_flight::start(const featureset_ptr &source) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    source_ = source;
+    started_ = true;
+    if (!source_)
+        finish();
+
+    started_cond_.notify_all();
+}
+
+void mongodb_flight::fail(const std::string &error) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    error_ = error;
+    started_ = true;
+    finish();
+
+    started_cond_.notify_all();
+}
+
+void mongodb_flight::finish() {
+    done_ = true;
+    source_.reset();
+
+    // later requests must not replay a finished query
+    mongodb_flight_registry::instance().remove(key_, this);
+}
+
+feature_ptr mongodb_flight::next(size_t &pos) {
+    feature_ptr feature;
+
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        while (!started_)
+            started_cond_.wait(lock);
+
+        if (pos < features_.size())
+            feature = features_[pos++];
+        else if (done_) {
+            if (!error_.empty())
+                throw mapnik::datasource_exception(error_);
+            return feature_ptr();
+        } else {
+            // readers waiting on the lock meanwhile want this same feature
+            try {
+                feature = source_->next();
+            } catch (std::exception &e) {
+                error_ = e.what();
+                finish();
+                throw;
+            }
+
+            if (!feature) {
+                finish();
+                return feature;
+            }
+
+            features_.push_back(feature);
+            ++pos;
+        }
+    }
+
+    // the recorded features are only ever copied, every reader renders
+    // its own since geometries carry a mutable vertex iterator
+    return mongodb_feature_cache::copy(feature);
+}
+
+mongodb_flight_ptr mongodb_flight_registry::join(const std::string &key, bool &leader) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    mongodb_flight_ptr flight;
+    FlightType::iterator itr = flights_.find(key);
+    if (itr != flights_.end())
+        flight = itr->second.second.lock();
+
+    leader = !flight;
+    if (leader) {
+        flight = boost::make_shared<mongodb_flight>(key);
+        flights_[key] = std::make_pair(flight.get(), boost::weak_ptr<mongodb_flight>(flight));
+    }
+
+    return flight;
+}
+
+void mongodb_flight_registry::remove(const std::string &key, const mongodb_flight *flight) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    // the entry may already belong to a newer flight
+    FlightType::iterator itr = flights_.find(key);
+    if (itr != flights_.end() && itr->second.first == flight)
+        flights_.erase(itr);
+}
+
+mongodb_coalesced_featureset::mongodb_coalesced_featureset(const mongodb_flight_ptr &flight)
+    : flight_(flight),
+      pos_(0) {
+}
+
+mongodb_coalesced_featureset::~mongodb_coalesced_featureset() {
+}
+
+feature_ptr mongodb_coalesced_featureset::next() {
+    return flight_->next(pos_);
+}
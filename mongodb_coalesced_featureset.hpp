@@ -0,0 +1,107 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_COALESCED_FEATURESET_HPP
+#define MONGODB_COALESCED_FEATURESET_HPP
+
+// mapnik
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/utils.hpp>
+
+// boost
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// stl
+#include <string>
+#include <vector>
+#include <map>
+
+using mapnik::featureset_ptr;
+using mapnik::feature_ptr;
+using mapnik::singleton;
+using mapnik::CreateStatic;
+
+// One query shared by every featureset that asked for the same thing while
+// it was running. Whichever reader gets past the features read so far
+// pulls the next one from the source; all readers see the same sequence,
+// each as copies of its own.
+class mongodb_flight : private boost::noncopyable {
+    std::string key_;
+    featureset_ptr source_;
+    std::vector<feature_ptr> features_;
+    bool started_;
+    bool done_;
+    std::string error_;
+    boost::mutex mutex_;
+    boost::condition_variable started_cond_;
+
+    void finish();
+
+public:
+    explicit mongodb_flight(const std::string &key);
+    ~mongodb_flight();
+
+    // called once by the reader that created the flight
+    void start(const featureset_ptr &source);
+    void fail(const std::string &error);
+
+    feature_ptr next(size_t &pos);
+};
+
+typedef boost::shared_ptr<mongodb_flight> mongodb_flight_ptr;
+
+// Queries in flight by key. Entries are dropped once a query has been
+// read to the end, later requests start a new one.
+class mongodb_flight_registry : public singleton<mongodb_flight_registry, CreateStatic> {
+    friend class CreateStatic<mongodb_flight_registry>;
+    // the raw pointer identifies the entry without taking ownership, so a
+    // flight being destroyed can still remove itself
+    typedef std::map<std::string, std::pair<const mongodb_flight *, boost::weak_ptr<mongodb_flight> > > FlightType;
+
+    FlightType flights_;
+    boost::mutex mutex_;
+
+public:
+    // the flight running for key, or a new one to start when leader is set
+    mongodb_flight_ptr join(const std::string &key, bool &leader);
+    void remove(const std::string &key, const mongodb_flight *flight);
+};
+
+// Reads a shared flight from the beginning.
+class mongodb_coalesced_featureset : public mapnik::Featureset {
+    mongodb_flight_ptr flight_;
+    size_t pos_;
+
+public:
+    mongodb_coalesced_featureset(const mongodb_flight_ptr &flight);
+    ~mongodb_coalesced_featureset();
+
+    feature_ptr next();
+};
+
+#endif // MONGODB_COALESCED_FEATURESET_HPP
@@ -29,15 +29,596 @@
 #include <mapnik/feature_layer_desc.hpp>
 #include <mapnik/unicode.hpp>
 #include <mapnik/params.hpp>
+#include <mapnik/wkb.hpp>
+#include <mapnik/vertex.hpp>
+
+// boost
+#include <boost/cstdint.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 
 // std
 #include <string>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <algorithm>
 
 #include "mongodb_converter.hpp"
 
 using mapnik::feature_ptr;
 using mapnik::geometry_type;
 
+namespace {
+
+// Adds vertices to a path, dropping those within tolerance of the last
+// one kept but always keeping the final vertex so rings stay closed.
+class path_builder {
+    geometry_type &geom_;
+    double tolerance_;
+    double x_, y_, last_x_, last_y_;
+    bool first_, pending_;
+
+public:
+    path_builder(geometry_type &geom, double tolerance)
+        : geom_(geom), tolerance_(tolerance),
+          x_(0), y_(0), last_x_(0), last_y_(0), first_(true), pending_(false) {}
+
+    void add(double x, double y) {
+        x_ = x;
+        y_ = y;
+
+        if (first_) {
+            geom_.move_to(x, y);
+            first_ = false;
+        } else if (tolerance_ > 0 && std::fabs(x - last_x_) < tolerance_ && std::fabs(y - last_y_) < tolerance_) {
+            pending_ = true;
+            return;
+        } else
+            geom_.line_to(x, y);
+
+        last_x_ = x;
+        last_y_ = y;
+        pending_ = false;
+    }
+
+    bool finish(bool close) {
+        if (first_)
+            return false;
+
+        if (pending_)
+            geom_.line_to(x_, y_);
+
+        if (close)
+            geom_.close_path();
+
+        return true;
+    }
+};
+
+template <typename T>
+void append_ndr(std::string &out, T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+#ifdef MAPNIK_BIG_ENDIAN
+    std::reverse(bytes, bytes + sizeof(T));
+#endif
+    out.append(bytes, sizeof(T));
+}
+
+// Liang-Barsky clipping of segment (x0, y0)-(x1, y1) against box
+bool segment_intersects(double x0, double y0, double x1, double y1, const mapnik::box2d<double> &box) {
+    double t0 = 0, t1 = 1;
+    double dx = x1 - x0, dy = y1 - y0;
+    double p[4] = { -dx, dx, -dy, dy };
+    double q[4] = { x0 - box.minx(), box.maxx() - x0, y0 - box.miny(), box.maxy() - y0 };
+
+    for (int i = 0; i < 4; ++i) {
+        if (p[i] == 0) {
+            if (q[i] < 0)
+                return false;
+        } else {
+            double t = q[i] / p[i];
+            if (p[i] < 0)
+                t0 = std::max(t0, t);
+            else
+                t1 = std::min(t1, t);
+            if (t0 > t1)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// header of a packed geometry, vertices follow the part offsets
+struct packed_header {
+    boost::int32_t type;
+    boost::int32_t parts;
+    const char *offsets;
+    const char *xy;
+    boost::int32_t vertices;
+};
+
+bool read_packed(const char *data, int length, packed_header &h) {
+    if (length < 8)
+        return false;
+
+    mapnik::read_int32_ndr(data, h.type);
+    mapnik::read_int32_ndr(data + 4, h.parts);
+    if (h.parts < 1 || (length - 8) / 4 < h.parts)
+        return false;
+
+    h.offsets = data + 8;
+    h.xy = h.offsets + 4 * h.parts;
+    mapnik::read_int32_ndr(h.offsets + 4 * (h.parts - 1), h.vertices);
+
+    return h.vertices > 0 && (data + length - h.xy) / 16 >= h.vertices;
+}
+
+// spherical mercator on the WGS84 semi-major axis, latitudes clamped where
+// the projected world becomes square
+const double earth_radius = 6378137.0;
+const double max_latitude = 85.0511287798066;
+
+}
+
+const int mongodb_converter::packed_subtype;
+
+bool mongodb_converter::decode_position(const mongo::BSONElement &pos, double &x, double &y) {
+    if (pos.type() != mongo::Array)
+        return false;
+
+    mongo::BSONObjIterator itr(pos.embeddedObject());
+    if (!itr.more())
+        return false;
+    mongo::BSONElement ex = itr.next();
+    if (!itr.more())
+        return false;
+    mongo::BSONElement ey = itr.next();
+
+    if (!ex.isNumber() || !ey.isNumber())
+        return false;
+
+    x = ex.numberDouble();
+    y = ey.numberDouble();
+    return true;
+}
+
+bool mongodb_converter::decode_path(const mongo::BSONElement &coords, geometry_type &geom, bool close, double tolerance,
+                                    std::vector<double> *mercator) {
+    if (coords.type() != mongo::Array)
+        return false;
+
+    path_builder path(geom, tolerance);
+    double x, y;
+
+    if (!mercator) {
+        for (mongo::BSONObjIterator itr(coords.embeddedObject()); itr.more(); ) {
+            if (!decode_position(itr.next(), x, y))
+                return false;
+
+            path.add(x, y);
+        }
+
+        return path.finish(close);
+    }
+
+    // gather the ring, project it in one pass, then simplify in map units
+    mercator->clear();
+    for (mongo::BSONObjIterator itr(coords.embeddedObject()); itr.more(); ) {
+        if (!decode_position(itr.next(), x, y))
+            return false;
+
+        mercator->push_back(x);
+        mercator->push_back(y);
+    }
+
+    size_t count = mercator->size() / 2;
+    if (count == 0)
+        return false;
+
+    to_mercator(&(*mercator)[0], count);
+    for (size_t i = 0; i < count; ++i)
+        path.add((*mercator)[2 * i], (*mercator)[2 * i + 1]);
+
+    return path.finish(close);
+}
+
+bool mongodb_converter::decode_packed(const char *data, int length, feature_ptr feature, double tolerance,
+                                      std::vector<double> *mercator) {
+    packed_header h;
+    if (!read_packed(data, length, h))
+        return false;
+
+    mapnik::eGeomType type;
+    switch (h.type) {
+    case 1: type = mapnik::Point; break;
+    case 2: type = mapnik::LineString; break;
+    case 3: type = mapnik::Polygon; break;
+    default: return false;
+    }
+
+    std::auto_ptr<geometry_type> geom(new geometry_type(type));
+    const char *xy = h.xy;
+    boost::int32_t begin = 0;
+
+    for (boost::int32_t part = 0; part < h.parts; ++part) {
+        boost::int32_t end;
+        mapnik::read_int32_ndr(h.offsets + 4 * part, end);
+        if (end <= begin || end > h.vertices)
+            return false;
+
+        path_builder path(*geom, type == mapnik::Point ? 0.0 : tolerance);
+        if (mercator) {
+            size_t count = end - begin;
+            mercator->resize(2 * count);
+            for (size_t i = 0; i < 2 * count; ++i, xy += 8)
+                mapnik::read_double_ndr(xy, (*mercator)[i]);
+
+            to_mercator(&(*mercator)[0], count);
+            for (size_t i = 0; i < count; ++i)
+                path.add((*mercator)[2 * i], (*mercator)[2 * i + 1]);
+            begin = end;
+        } else {
+            for (; begin < end; ++begin, xy += 16) {
+                double x, y;
+                mapnik::read_double_ndr(xy, x);
+                mapnik::read_double_ndr(xy + 8, y);
+                path.add(x, y);
+            }
+        }
+
+        if (!path.finish(type == mapnik::Polygon))
+            return false;
+    }
+
+    feature->paths().push_back(geom);
+    return true;
+}
+
+bool mongodb_converter::decode_binary(const mongo::BSONElement &loc, feature_ptr feature, double tolerance,
+                                      std::vector<double> *mercator) {
+    int length;
+    const char *data = loc.binData(length);
+
+    if (loc.binDataType() == packed_subtype)
+        return decode_packed(data, length, feature, tolerance, mercator);
+
+    size_t first = feature->paths().size();
+    if (!mapnik::geometry_utils::from_wkb(feature->paths(), data, length, mapnik::wkbGeneric))
+        return false;
+
+    if (tolerance > 0 || mercator)
+        rebuild_paths(feature->paths(), first, tolerance, mercator);
+
+    return true;
+}
+
+void mongodb_converter::rebuild_paths(boost::ptr_vector<geometry_type> &paths, size_t first, double tolerance,
+                                      std::vector<double> *mercator) {
+    // vertices can't be moved or dropped in place, so each path is rebuilt
+    std::vector<double> local;
+    std::vector<double> &xy = mercator ? *mercator : local;
+    std::vector<unsigned> commands;
+
+    for (size_t p = first; p < paths.size(); ++p) {
+        const geometry_type &geom = paths[p];
+        size_t count = geom.size();
+        if (count == 0)
+            continue;
+
+        xy.resize(2 * count);
+        commands.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            commands[i] = geom.vertex(i, &xy[2 * i], &xy[2 * i + 1]);
+
+        if (mercator)
+            to_mercator(&xy[0], count);
+
+        std::auto_ptr<geometry_type> rebuilt(new geometry_type(geom.type()));
+        double ring_tolerance = geom.type() == mapnik::Point ? 0.0 : tolerance;
+
+        // a ring runs from a move to the next move or close
+        for (size_t i = 0; i < count; ) {
+            if (commands[i] == mapnik::SEG_CLOSE) {
+                ++i;
+                continue;
+            }
+
+            path_builder path(*rebuilt, ring_tolerance);
+            path.add(xy[2 * i], xy[2 * i + 1]);
+            for (++i; i < count && commands[i] == mapnik::SEG_LINETO; ++i)
+                path.add(xy[2 * i], xy[2 * i + 1]);
+
+            path.finish(i < count && commands[i] == mapnik::SEG_CLOSE);
+        }
+
+        paths.replace(p, rebuilt.release());
+    }
+}
+
+void mongodb_converter::to_mercator(double *xy, size_t count) {
+    // two branch-free passes over the ring: the scaling and clamping pass
+    // is plain arithmetic, the log/tan calls are left on their own
+    const double scale = earth_radius * M_PI / 180.0;
+    const double half = M_PI / 360.0;
+
+    for (size_t i = 0; i < 2 * count; i += 2) {
+        xy[i] *= scale;
+        xy[i + 1] = std::max(-max_latitude, std::min(max_latitude, xy[i + 1]));
+    }
+
+    for (size_t i = 1; i < 2 * count; i += 2)
+        xy[i] = earth_radius * std::log(std::tan(M_PI / 4 + xy[i] * half));
+}
+
+mapnik::box2d<double> mongodb_converter::to_mercator(const mapnik::box2d<double> &box) {
+    // the projection is monotonic on both axes, so corners map to corners
+    double xy[4] = { box.minx(), box.miny(), box.maxx(), box.maxy() };
+    to_mercator(xy, 2);
+
+    return mapnik::box2d<double>(xy[0], xy[1], xy[2], xy[3]);
+}
+
+mapnik::box2d<double> mongodb_converter::from_mercator(const mapnik::box2d<double> &box) {
+    const double scale = 180.0 / (earth_radius * M_PI);
+    double miny = (2 * std::atan(std::exp(box.miny() / earth_radius)) - M_PI / 2) * 180.0 / M_PI;
+    double maxy = (2 * std::atan(std::exp(box.maxy() / earth_radius)) - M_PI / 2) * 180.0 / M_PI;
+
+    // tiles may reach past the antimeridian, lon/lat queries can't
+    return mapnik::box2d<double>(std::max(box.minx() * scale, -180.0), miny,
+                                 std::min(box.maxx() * scale, 180.0), maxy);
+}
+
+bool mongodb_converter::decode_geometry(const mongo::BSONElement &loc, feature_ptr feature, double tolerance,
+                                        std::vector<double> *mercator) {
+    if (loc.type() == mongo::BinData)
+        return decode_binary(loc, feature, tolerance, mercator);
+
+    if (loc.type() != mongo::Object)
+        return false;
+
+    mongo::BSONObj obj = loc.embeddedObject();
+    mongo::BSONElement type = obj.getField("type");
+    mongo::BSONElement coords = obj.getField("coordinates");
+
+    if (type.type() != mongo::String || coords.type() != mongo::Array)
+        return false;
+
+    const char *name = type.valuestr();
+
+    if (std::strcmp(name, "Point") == 0) {
+        double x, y;
+        if (!decode_position(coords, x, y))
+            return false;
+
+        if (mercator) {
+            double xy[2] = { x, y };
+            to_mercator(xy, 1);
+            x = xy[0];
+            y = xy[1];
+        }
+
+        std::auto_ptr<geometry_type> point(new geometry_type(mapnik::Point));
+        point->move_to(x, y);
+        feature->paths().push_back(point);
+    } else if (std::strcmp(name, "LineString") == 0) {
+        std::auto_ptr<geometry_type> line(new geometry_type(mapnik::LineString));
+        if (!decode_path(coords, *line, false, tolerance, mercator))
+            return false;
+
+        feature->paths().push_back(line);
+    } else if (std::strcmp(name, "Polygon") == 0) {
+        std::auto_ptr<geometry_type> poly(new geometry_type(mapnik::Polygon));
+
+        // exterior ring first, then interiors, all in one path
+        for (mongo::BSONObjIterator itr(coords.embeddedObject()); itr.more(); )
+            if (!decode_path(itr.next(), *poly, true, tolerance, mercator))
+                return false;
+
+        if (poly->size() == 0)
+            return false;
+
+        feature->paths().push_back(poly);
+    } else
+        return false;
+
+    return true;
+}
+
+void mongodb_converter::expand_coords(const mongo::BSONElement &coords, mapnik::box2d<double> &ext, bool &initialized) {
+    double x, y;
+
+    if (decode_position(coords, x, y)) {
+        if (initialized)
+            ext.expand_to_include(x, y);
+        else {
+            ext.init(x, y, x, y);
+            initialized = true;
+        }
+    } else if (coords.type() == mongo::Array)
+        for (mongo::BSONObjIterator itr(coords.embeddedObject()); itr.more(); )
+            expand_coords(itr.next(), ext, initialized);
+}
+
+void mongodb_converter::expand_envelope(const mongo::BSONElement &loc, mapnik::box2d<double> &ext, bool &initialized) {
+    if (loc.type() == mongo::Object)
+        expand_coords(loc.embeddedObject().getField("coordinates"), ext, initialized);
+    else if (loc.type() == mongo::BinData) {
+        int length;
+        const char *data = loc.binData(length);
+        packed_header h;
+
+        if (loc.binDataType() == packed_subtype) {
+            if (!read_packed(data, length, h))
+                return;
+
+            for (boost::int32_t i = 0; i < h.vertices; ++i) {
+                double x, y;
+                mapnik::read_double_ndr(h.xy + 16 * i, x);
+                mapnik::read_double_ndr(h.xy + 16 * i + 8, y);
+
+                if (initialized)
+                    ext.expand_to_include(x, y);
+                else {
+                    ext.init(x, y, x, y);
+                    initialized = true;
+                }
+            }
+        } else {
+            boost::ptr_vector<geometry_type> paths;
+            if (!mapnik::geometry_utils::from_wkb(paths, data, length, mapnik::wkbGeneric))
+                return;
+
+            for (boost::ptr_vector<geometry_type>::const_iterator itr = paths.begin(); itr != paths.end(); ++itr) {
+                if (itr->size() == 0)
+                    continue;
+
+                if (initialized)
+                    ext.expand_to_include(itr->envelope());
+                else {
+                    ext = itr->envelope();
+                    initialized = true;
+                }
+            }
+        }
+    }
+}
+
+bool mongodb_converter::is_point(const mongo::BSONElement &loc) {
+    if (loc.type() == mongo::Object)
+        return std::strcmp(loc.embeddedObject().getStringField("type"), "Point") == 0;
+
+    if (loc.type() != mongo::BinData)
+        return false;
+
+    int length;
+    const char *data = loc.binData(length);
+    boost::int32_t type;
+
+    if (loc.binDataType() == packed_subtype) {
+        if (length < 4)
+            return false;
+        mapnik::read_int32_ndr(data, type);
+        return type == 1;
+    }
+
+    // WKB: byte order, then the type in that order; ISO 3D/M types add thousands
+    if (length < 5)
+        return false;
+    if (data[0] == 1)
+        mapnik::read_int32_ndr(data + 1, type);
+    else
+        mapnik::read_int32_xdr(data + 1, type);
+    return type % 1000 == 1;
+}
+
+bool mongodb_converter::intersects(const geometry_type &geom, const mapnik::box2d<double> &box) {
+    if (geom.size() == 0 || !box.intersects(geom.envelope()))
+        return false;
+
+    // any vertex inside or edge crossing the box is a hit; otherwise a
+    // polygon can only intersect by containing the box, tested with the
+    // even-odd rule on its center
+    bool polygon = geom.type() == mapnik::Polygon;
+    mapnik::coord2d c = box.center();
+    bool contains = false;
+    double x, y, start_x = 0, start_y = 0, prev_x = 0, prev_y = 0;
+
+    for (unsigned i = 0; i < geom.size(); ++i) {
+        unsigned cmd = geom.vertex(i, &x, &y);
+
+        if (cmd == mapnik::SEG_CLOSE) {
+            x = start_x;
+            y = start_y;
+        } else if (box.contains(x, y))
+            return true;
+
+        if (cmd == mapnik::SEG_MOVETO) {
+            start_x = x;
+            start_y = y;
+        } else {
+            if (segment_intersects(prev_x, prev_y, x, y, box))
+                return true;
+
+            if (polygon && (prev_y > c.y) != (y > c.y) &&
+                c.x < prev_x + (x - prev_x) * (c.y - prev_y) / (y - prev_y))
+                contains = !contains;
+        }
+
+        prev_x = x;
+        prev_y = y;
+    }
+
+    return contains;
+}
+
+bool mongodb_converter::encode_packed(const mongo::BSONElement &loc, std::string &out) {
+    if (loc.type() != mongo::Object)
+        return false;
+
+    mongo::BSONObj obj = loc.embeddedObject();
+    mongo::BSONElement coords = obj.getField("coordinates");
+    const char *name = obj.getStringField("type");
+    boost::int32_t type;
+    std::vector<mongo::BSONElement> parts;
+
+    if (coords.type() != mongo::Array)
+        return false;
+
+    if (std::strcmp(name, "Point") == 0) {
+        type = 1;
+        parts.push_back(coords);
+    } else if (std::strcmp(name, "LineString") == 0) {
+        type = 2;
+        parts.push_back(coords);
+    } else if (std::strcmp(name, "Polygon") == 0) {
+        type = 3;
+        for (mongo::BSONObjIterator itr(coords.embeddedObject()); itr.more(); )
+            parts.push_back(itr.next());
+    } else
+        return false;
+
+    if (parts.empty())
+        return false;
+
+    std::string xy;
+    std::vector<boost::int32_t> offsets;
+    boost::int32_t vertices = 0;
+    double x, y;
+
+    for (std::vector<mongo::BSONElement>::const_iterator part = parts.begin(); part != parts.end(); ++part) {
+        if (type == 1) {
+            if (!decode_position(*part, x, y))
+                return false;
+            append_ndr(xy, x);
+            append_ndr(xy, y);
+            ++vertices;
+        } else {
+            if (part->type() != mongo::Array)
+                return false;
+
+            for (mongo::BSONObjIterator itr(part->embeddedObject()); itr.more(); ++vertices) {
+                if (!decode_position(itr.next(), x, y))
+                    return false;
+                append_ndr(xy, x);
+                append_ndr(xy, y);
+            }
+        }
+        offsets.push_back(vertices);
+    }
+
+    out.clear();
+    out.reserve(8 + 4 * offsets.size() + xy.size());
+    append_ndr(out, type);
+    append_ndr(out, static_cast<boost::int32_t>(offsets.size()));
+    for (std::vector<boost::int32_t>::const_iterator itr = offsets.begin(); itr != offsets.end(); ++itr)
+        append_ndr(out, *itr);
+    out.append(xy);
+
+    return true;
+}
+
 void mongodb_converter::convert_geometry(const mongo::BSONElement &loc, feature_ptr feature) {
     std::string type = loc["type"].String();
     std::vector<mongo::BSONElement> coords = loc["coordinates"].Array();
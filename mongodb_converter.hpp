@@ -26,15 +26,65 @@
 
 // mapnik
 #include <mapnik/datasource.hpp>
+#include <mapnik/geometry.hpp>
+#include <mapnik/box2d.hpp>
+
+// boost
+#include <boost/ptr_container/ptr_vector.hpp>
 
 // mongo
 #include <mongo/client/dbclientcursor.h>
 
 // std
 #include <vector>
+#include <string>
 
+// Geometry is read either from GeoJSON or from a BinData field holding
+// WKB (any subtype but packed_subtype) or the packed encoding: all
+// little-endian, an int32 type (1 Point, 2 LineString, 3 Polygon), an
+// int32 number of parts (rings), one int32 end offset per part counted
+// in vertices, then the x,y doubles of all vertices.
+//
+// Decoders taking a scratch buffer project lon/lat to spherical mercator
+// on the way, a whole ring at a time through the buffer.
 class mongodb_converter {
+    static bool decode_position(const mongo::BSONElement &pos, double &x, double &y);
+    static bool decode_path(const mongo::BSONElement &coords, mapnik::geometry_type &geom, bool close, double tolerance,
+                            std::vector<double> *mercator);
+    static void expand_coords(const mongo::BSONElement &coords, mapnik::box2d<double> &ext, bool &initialized);
+    static bool decode_packed(const char *data, int length, mapnik::feature_ptr feature, double tolerance,
+                              std::vector<double> *mercator);
+    static bool decode_binary(const mongo::BSONElement &loc, mapnik::feature_ptr feature, double tolerance,
+                              std::vector<double> *mercator);
+    static void rebuild_paths(boost::ptr_vector<mapnik::geometry_type> &paths, size_t first, double tolerance,
+                              std::vector<double> *mercator);
+
 public:
+    static const int packed_subtype = mongo::bdtCustom;
+
+    // streaming decoder: walks the BSON buffer in place, no per-vertex allocations
+    // tolerance > 0 drops vertices closer than that to the last emitted one
+    // mercator, when given, switches output to spherical mercator
+    static bool decode_geometry(const mongo::BSONElement &loc, mapnik::feature_ptr feature, double tolerance = 0.0,
+                                std::vector<double> *mercator = 0);
+
+    // projects count interleaved lon/lat pairs to spherical mercator in place
+    static void to_mercator(double *xy, size_t count);
+    static mapnik::box2d<double> to_mercator(const mapnik::box2d<double> &box);
+    static mapnik::box2d<double> from_mercator(const mapnik::box2d<double> &box);
+
+    // grows ext by the coordinates of a geometry without building it
+    static void expand_envelope(const mongo::BSONElement &loc, mapnik::box2d<double> &ext, bool &initialized);
+
+    static bool is_point(const mongo::BSONElement &loc);
+
+    // exact planar test of a decoded geometry against a box
+    static bool intersects(const mapnik::geometry_type &geom, const mapnik::box2d<double> &box);
+
+    // packed encoding of a GeoJSON geometry, false if it can't be encoded
+    static bool encode_packed(const mongo::BSONElement &loc, std::string &out);
+
+    // reference decoder built on BSONElement::Array()
     static void convert_geometry(const mongo::BSONElement &loc, mapnik::feature_ptr feature);
 
     static void convert_point(const std::vector<mongo::BSONElement> &coords, mapnik::feature_ptr feature);
@@ -23,7 +23,12 @@
 
 #include "mongodb_datasource.hpp"
 #include "mongodb_featureset.hpp"
+#include "mongodb_prefetch_featureset.hpp"
+#include "mongodb_cached_featureset.hpp"
+#include "mongodb_merged_featureset.hpp"
+#include "mongodb_coalesced_featureset.hpp"
 #include "connection_manager.hpp"
+#include "mongodb_converter.hpp"
 
 // mapnik
 #include <mapnik/debug.hpp>
@@ -33,6 +38,7 @@
 #include <mapnik/util/conversions.hpp>
 #include <mapnik/timer.hpp>
 #include <mapnik/value_types.hpp>
+#include <mapnik/well_known_srs.hpp>
 
 // boost
 #include <boost/algorithm/string.hpp>
@@ -45,6 +51,7 @@
 #include <set>
 #include <sstream>
 #include <iomanip>
+#include <cmath>
 
 DATASOURCE_PLUGIN(mongodb_datasource)
 
@@ -60,11 +67,68 @@ mongodb_datasource::mongodb_datasource(parameters const& params)
                params.get<std::string>("dbname", "gis"),
                params.get<std::string>("collection"),
                params.get<std::string>("user"),
-               params.get<std::string>("password")),
+               params.get<std::string>("password"),
+               params.get<std::string>("replica_set"),
+               params.get<std::string>("read_preference")),
       persist_connection_(*params.get<mapnik::boolean>("persist_connection", true)),
+      prefetch_(*params.get<mapnik::boolean>("prefetch", false)),
+      decode_threads_(std::max(*params.get<int>("decode_threads", 1), 1)),
+      prefetch_size_(std::max(*params.get<int>("prefetch_size", 1000), 1)),
+      batch_size_(std::max(*params.get<int>("batch_size", 0), 0)),
+      exhaust_(*params.get<mapnik::boolean>("exhaust", false)),
+      max_time_ms_(std::max(*params.get<int>("max_time_ms", 0), 0)),
+      fanout_(std::max(*params.get<int>("fanout", 1), 1)),
+      cache_size_(static_cast<size_t>(std::max(*params.get<int>("cache_size_mb", 0), 0)) * 1024 * 1024),
+      cache_ttl_(std::max(*params.get<int>("cache_ttl", 300), 0)),
+      coalesce_(*params.get<mapnik::boolean>("coalesce", false)),
+      estimate_extent_(*params.get<mapnik::boolean>("estimate_extent", false)),
+      extent_precision_(std::max(*params.get<double>("extent_precision", 0.01), 1e-6)),
+      persist_extent_(*params.get<mapnik::boolean>("persist_extent", false)),
+      metadata_collection_(*params.get<std::string>("metadata_collection", "mapnik_metadata")),
+      binary_geometry_(boost::trim_copy(*params.get<std::string>("binary_geometry", ""))),
+      geometry_lod_(parse_lod(*params.get<std::string>("geometry_lod", ""))),
+      simplify_(*params.get<double>("simplify", 0.0)),
+      stats_(boost::make_shared<mongodb_stats>()),
+      schema_sample_size_(std::max(*params.get<int>("schema_sample_size", 100), 1)),
+      filter_(boost::trim_copy(*params.get<std::string>("filter", ""))),
+      query_mode_(query_2dsphere),
+      point_limit_(std::max(*params.get<int>("point_limit", 0), 0)),
+      pipeline_(boost::trim_copy(*params.get<std::string>("pipeline", ""))),
+      cluster_(false),
+      cluster_size_(std::max(*params.get<int>("cluster_size", 32), 1)),
+      aggregate_min_scale_(*params.get<double>("aggregate_min_scale", 0.0)),
+      thin_(*params.get<mapnik::boolean>("thin", false)),
+      thin_size_(std::max(*params.get<double>("thin_size", 1.0), 0.0)),
+      thin_lines_(*params.get<mapnik::boolean>("thin_lines", false)),
+      thin_priority_(boost::trim_copy(*params.get<std::string>("thin_priority", ""))),
+      mercator_(*params.get<mapnik::boolean>("mercator", false)),
       extent_initialized_(false) {
     if (!params.get<std::string>("collection"))
         throw mapnik::datasource_exception("MongoDB Plugin: missing <collection> parameter");
+
+    std::string mode = *params.get<std::string>("query_mode", "2dsphere");
+    if (mode == "2d")
+        query_mode_ = query_2d;
+    else if (mode == "bbox")
+        query_mode_ = query_bbox;
+    else if (mode != "2dsphere")
+        throw mapnik::datasource_exception("MongoDB Plugin: unknown query_mode '" + mode + "'");
+
+    // the probes bisect the lon/lat world, bbox fields may be projected
+    if (estimate_extent_ && query_mode_ == query_bbox)
+        throw mapnik::datasource_exception("MongoDB Plugin: estimate_extent is not supported in bbox query_mode, give the extent instead");
+
+    std::string cluster = *params.get<std::string>("cluster", "");
+    if (cluster == "grid")
+        cluster_ = true;
+    else if (!cluster.empty())
+        throw mapnik::datasource_exception("MongoDB Plugin: unknown cluster mode '" + cluster + "'");
+
+    // features come out projected, so the layer has to be in mercator too
+    // for mapnik to leave them alone
+    if (mercator_)
+        params_["srs"] = std::string(mapnik::MAPNIK_GMERC_PROJ);
+
     boost::optional<std::string> ext = params.get<std::string>("extent");
     if (ext && !ext->empty())
         extent_initialized_ = extent_.from_string(*ext);
@@ -72,14 +136,52 @@ mongodb_datasource::mongodb_datasource(parameters const& params)
     boost::optional<int> initial_size = params.get<int>("initial_size", 1);
     boost::optional<int> max_size = params.get<int>("max_size", 10);
 
-    ConnectionManager::instance().registerPool(creator_, *initial_size, *max_size);
+    int health_check_interval = *params.get<int>("health_check_interval", 30);
+
+    pool_ = ConnectionManager::instance().registerPool(creator_, *initial_size, *max_size, health_check_interval);
+
+    lod_table collections = parse_lod(*params.get<std::string>("collection_lod", ""));
+    for (lod_table::const_iterator itr = collections.begin(); itr != collections.end(); ++itr) {
+        ConnectionCreator<Connection> creator(params.get<std::string>("host", "localhost"),
+                                              params.get<std::string>("port", "27017"),
+                                              params.get<std::string>("dbname", "gis"),
+                                              itr->second,
+                                              params.get<std::string>("user"),
+                                              params.get<std::string>("password"),
+                                              params.get<std::string>("replica_set"),
+                                              params.get<std::string>("read_preference"));
+
+        collection_lod_.push_back(std::make_pair(itr->first,
+                                                 ConnectionManager::instance().registerPool(creator, *initial_size, *max_size,
+                                                                                            health_check_interval)));
+    }
+
+    if (cache_size_ > 0)
+        mongodb_feature_cache::instance().reserve(cache_size_);
+
+    boost::optional<mongodb_schema> schema = mongodb_metadata_cache::instance().schema(creator_.id());
+    if (!schema) {
+        shared_ptr<Connection> conn = pool_->borrowObject();
+
+        if (conn && conn->isOK()) {
+            schema.reset(sample_schema(*conn));
+            mongodb_metadata_cache::instance().set_schema(creator_.id(), *schema);
+        }
+    }
+
+    if (schema) {
+        for (std::vector<attribute_descriptor>::const_iterator itr = schema->attributes.begin();
+             itr != schema->attributes.end(); ++itr)
+            desc_.add_descriptor(*itr);
+
+        geometry_type_ = schema->geometry_type;
+    }
 }
 
 mongodb_datasource::~mongodb_datasource() {
     if (!persist_connection_) {
-        shared_ptr< Pool<Connection, ConnectionCreator> > pool = ConnectionManager::instance().getPool(creator_.id());
-        if (pool) {
-            shared_ptr<Connection> conn = pool->borrowObject();
+        if (pool_) {
+            shared_ptr<Connection> conn = pool_->borrowObject();
             if (conn)
                 conn->close();
         }
@@ -98,40 +200,526 @@ layer_descriptor mongodb_datasource::get_descriptor() const {
     return desc_;
 }
 
-std::string mongodb_datasource::json_bbox(const box2d<double> &env) const {
+std::string mongodb_datasource::json_bbox(const box2d<double> &env, const std::string &filter) const {
     std::ostringstream lookup;
 
-    if (abs(env.maxx() - env.minx()) > 180 ||
-        abs(env.maxy() - env.miny()) > 180)
-        throw mapnik::datasource_exception("try qo query more than a single hemisphere");
+    if (query_mode_ == query_2dsphere &&
+        (std::fabs(env.maxx() - env.minx()) >= 180 ||
+         std::fabs(env.maxy() - env.miny()) > 180))
+        throw mapnik::datasource_exception("MongoDB Plugin: can't query more than a single hemisphere at once");
+
+    // the user filter is and-ed with the spatial predicate so that
+    // compound indexes can serve both
+    if (!filter.empty())
+        lookup << "{ \"$and\": [ ";
+
+    lookup << std::setprecision(16);
+
+    switch (query_mode_) {
+    case query_2d: // legacy coordinate pairs, only points are indexed
+        lookup << "{ \"geometry.coordinates\": { \"$geoWithin\": { \"$box\": [ [ "
+               << env.minx() << ", " << env.miny() << " ], [ "
+               << env.maxx() << ", " << env.maxy() << " ] ] } } }";
+        break;
+
+    case query_bbox: // candidates whose bbox overlaps, refined on the client
+        lookup << "{ \"bbox.minx\": { \"$lte\": " << env.maxx() << " }, "
+               << "\"bbox.miny\": { \"$lte\": " << env.maxy() << " }, "
+               << "\"bbox.maxx\": { \"$gte\": " << env.minx() << " }, "
+               << "\"bbox.maxy\": { \"$gte\": " << env.miny() << " } }";
+        break;
+
+    default: {
+        // polygon edges are geodesics, so an edge along a parallel bows
+        // toward the pole; densify those edges and move the one bowing into
+        // the box toward the equator until its bow just reaches the box
+        static const double max_step = 5.0;
+        int steps = std::max(static_cast<int>(std::ceil(env.width() / max_step)), 1);
+        double step = env.width() / steps;
+        double bow = std::cos(step * M_PI / 360.0);
+        double miny = env.miny(), maxy = env.maxy();
+        if (miny > 0)
+            miny = std::atan(std::tan(miny * M_PI / 180.0) * bow) * 180.0 / M_PI;
+        if (maxy < 0)
+            maxy = std::atan(std::tan(maxy * M_PI / 180.0) * bow) * 180.0 / M_PI;
+
+        lookup << "{ geometry: { \"$geoIntersects\": { \"$geometry\": { type: \"Polygon\", coordinates: [ [ ";
+        for (int i = 0; i <= steps; ++i)
+            lookup << "[ " << (i == steps ? env.maxx() : env.minx() + step * i) << ", " << miny << " ], ";
+        for (int i = steps; i >= 0; --i)
+            lookup << "[ " << (i == steps ? env.maxx() : env.minx() + step * i) << ", " << maxy << " ], ";
+        lookup << "[ " << env.minx() << ", " << miny << " ] ] ] } } } }";
+    }
+    }
+
+    if (!filter.empty())
+        lookup << ", " << filter << " ] }";
+
+    return lookup.str();
+}
+
+std::string mongodb_datasource::json_near(const coord2d &pt, double tol, const std::string &filter) const {
+    // 2dsphere distances are in meters, tol is in degrees of latitude
+    static const double meters_per_degree = 6378137.0 * M_PI / 180.0;
+
+    std::ostringstream lookup;
+    lookup << std::setprecision(16);
+
+    if (query_mode_ == query_2d)
+        lookup << "{ \"geometry.coordinates\": { \"$near\": [ " << pt.x << ", " << pt.y << " ], "
+               << "\"$maxDistance\": " << tol << " } }";
+    else
+        lookup << "{ geometry: { \"$near\": { \"$geometry\": { type: \"Point\", coordinates: [ "
+               << pt.x << ", " << pt.y << " ] }, \"$maxDistance\": " << tol * meters_per_degree << " } } }";
+
+    if (filter.empty())
+        return lookup.str();
+
+    // $near isn't allowed under $and, so the filter goes alongside it
+    try {
+        mongo::BSONObjBuilder merged;
+        merged.appendElements(mongo::fromjson(lookup.str()));
+        merged.appendElements(mongo::fromjson(filter));
+        return merged.obj().jsonString();
+    } catch(mongo::DBException &de) {
+        std::string err_msg = "Mongodb Plugin: ";
+        err_msg += de.toString();
+        err_msg += "\n";
+        throw mapnik::datasource_exception(err_msg);
+    }
+}
+
+std::string mongodb_datasource::substitute_tokens(const std::string &text, const box2d<double> &env,
+                                                  double scale_denominator,
+                                                  double pixel_width, double pixel_height) const {
+    if (text.empty())
+        return text;
+
+    std::ostringstream bbox, scale, width, height;
+    bbox << std::setprecision(16)
+         << "[ [ " << env.minx() << ", " << env.miny() << " ], [ " << env.maxx() << ", " << env.maxy() << " ] ]";
+    scale << std::setprecision(16) << scale_denominator;
+    width << std::setprecision(16) << pixel_width;
+    height << std::setprecision(16) << pixel_height;
+
+    std::string result = text;
+    boost::algorithm::replace_all(result, "!bbox!", bbox.str());
+    boost::algorithm::replace_all(result, "!scale_denominator!", scale.str());
+    boost::algorithm::replace_all(result, "!pixel_width!", width.str());
+    boost::algorithm::replace_all(result, "!pixel_height!", height.str());
+
+    return result;
+}
+
+std::string mongodb_datasource::grid_pipeline(const std::set<std::string> &names) const {
+    // attributes that can be used as $group and $project field names
+    std::vector<std::string> fields;
+    for (std::set<std::string>::const_iterator itr = names.begin(); itr != names.end(); ++itr)
+        if (!itr->empty() && (*itr)[0] != '$' && itr->find('.') == std::string::npos &&
+            *itr != "count" && *itr != "_id" && *itr != "geometry")
+            fields.push_back(*itr);
+
+    // Points are snapped to a grid anchored at (-180, -90) so that cells
+    // are the same across tiles. Only operators available since 2.4 are
+    // used: the coordinates are unwound and regrouped per document to
+    // read x and y, as there is no $arrayElemAt.
+    std::ostringstream p;
+    p << "[ { \"$match\": !query! }, "
+      << "{ \"$project\": { geometry: 1, properties: 1, c: \"$geometry.coordinates\" } }, "
+      << "{ \"$unwind\": \"$c\" }, "
+      << "{ \"$group\": { _id: \"$_id\", geometry: { \"$first\": \"$geometry\" }, "
+      << "properties: { \"$first\": \"$properties\" }, "
+      << "x: { \"$first\": \"$c\" }, y: { \"$last\": \"$c\" } } }, "
+      << "{ \"$project\": { geometry: 1, properties: 1, "
+      << "gx: { \"$subtract\": [ { \"$add\": [ \"$x\", 180 ] }, "
+      << "{ \"$mod\": [ { \"$add\": [ \"$x\", 180 ] }, !cell_size! ] } ] }, "
+      << "gy: { \"$subtract\": [ { \"$add\": [ \"$y\", 90 ] }, "
+      << "{ \"$mod\": [ { \"$add\": [ \"$y\", 90 ] }, !cell_size! ] } ] } } }, "
+      << "{ \"$group\": { _id: { x: \"$gx\", y: \"$gy\" }, geometry: { \"$first\": \"$geometry\" }, "
+      << "count: { \"$sum\": 1 }";
+
+    for (std::vector<std::string>::const_iterator itr = fields.begin(); itr != fields.end(); ++itr)
+        p << ", \"" << *itr << "\": { \"$first\": \"$properties." << *itr << "\" }";
+
+    p << " } }, { \"$project\": { _id: 0, geometry: 1, properties: { count: \"$count\"";
+
+    for (std::vector<std::string>::const_iterator itr = fields.begin(); itr != fields.end(); ++itr)
+        p << ", \"" << *itr << "\": \"$" << *itr << "\"";
+
+    p << " } } } ]";
+
+    return p.str();
+}
+
+std::string mongodb_datasource::aggregation_pipeline(const box2d<double> &env, const std::set<std::string> &names,
+                                                     double scale_denominator, double resx, double resy,
+                                                     const std::string &filter) const {
+    if (pipeline_.empty() && !cluster_)
+        return std::string();
+
+    if (scale_denominator < aggregate_min_scale_)
+        return std::string();
+
+    // the grid cell is sized in pixels, so it needs the query resolution
+    if (cluster_ && resx <= 0)
+        return std::string();
+
+    // a single query, strips would only lengthen its $or
+    std::string match = json_boxes(hemispheres(env), filter);
+
+    std::ostringstream cell_size;
+    cell_size << std::setprecision(16) << (cluster_ ? cluster_size_ / resx : 0.0);
+
+    std::string pipeline = substitute_tokens(cluster_ ? grid_pipeline(names) : pipeline_,
+                                             env, scale_denominator,
+                                             resx > 0 ? 1.0 / resx : 0, resy > 0 ? 1.0 / resy : 0);
+    boost::algorithm::replace_all(pipeline, "!cell_size!", cell_size.str());
+    boost::algorithm::replace_all(pipeline, "!query!", match);
+
+    return pipeline;
+}
+
+std::string mongodb_datasource::json_boxes(const std::vector<box2d<double> > &boxes, const std::string &filter) const {
+    if (boxes.size() == 1)
+        return json_bbox(boxes[0], filter);
 
-    lookup << "{ geometry: { \"$geoIntersects\": { \"$geometry\": { type: \"Polygon\", coordinates: [ [ [ "
-           << std::setprecision(16)
-           << env.minx() << ", " << env.miny() << " ], [ "
-           << env.maxx() << ", " << env.miny() << " ], [ "
-           << env.maxx() << ", " << env.maxy() << " ], [ "
-           << env.minx() << ", " << env.maxy() << " ], [ "
-           << env.minx() << ", " << env.miny() << " ] ] ] } } } }";
+    std::ostringstream lookup;
+    lookup << "{ \"$or\": [ ";
+    for (std::vector<box2d<double> >::const_iterator itr = boxes.begin(); itr != boxes.end(); ++itr)
+        lookup << (itr == boxes.begin() ? "" : ", ") << json_bbox(*itr, filter);
+    lookup << " ] }";
 
     return lookup.str();
 }
 
+std::string mongodb_datasource::ordered(const std::string &query) const {
+    if (!thin_ || thin_priority_.empty())
+        return query;
+
+    // with thinning the first feature in a cell wins, so hand out the
+    // most important ones first
+    return "{ \"$query\": " + query + ", \"$orderby\": { \"properties." + thin_priority_ + "\": -1 } }";
+}
+
+std::vector<box2d<double> > mongodb_datasource::split_bbox(const box2d<double> &env) const {
+    return fan_out(hemispheres(env));
+}
+
+std::vector<box2d<double> > mongodb_datasource::hemispheres(const box2d<double> &env) const {
+    // planar range predicates have no hemisphere or antimeridian limits
+    if (query_mode_ == query_bbox)
+        return std::vector<box2d<double> >(1, env);
+
+    // a $geoIntersects polygon must fit in a hemisphere and must not
+    // touch a pole with distinct vertices, so cut the box at the
+    // antimeridian and cut anything a hemisphere wide or more into
+    // pieces at most 90 degrees wide
+    static const double max_width = 90.0;
+    static const double max_lat = 90.0 - 1e-6;
+
+    double miny = std::max(env.miny(), -max_lat);
+    double maxy = std::min(env.maxy(), max_lat);
+    std::vector<std::pair<double, double> > spans;
+
+    if (env.width() >= 360.0)
+        spans.push_back(std::make_pair(-180.0, 180.0));
+    else {
+        double minx = std::fmod(env.minx() + 180.0, 360.0);
+        if (minx < 0)
+            minx += 360.0;
+        minx -= 180.0;
+
+        double maxx = minx + env.width();
+        if (maxx > 180.0) {
+            spans.push_back(std::make_pair(minx, 180.0));
+            spans.push_back(std::make_pair(-180.0, maxx - 360.0));
+        } else
+            spans.push_back(std::make_pair(minx, maxx));
+    }
+
+    std::vector<box2d<double> > result;
+    for (std::vector<std::pair<double, double> >::const_iterator itr = spans.begin(); itr != spans.end(); ++itr) {
+        double width = itr->second - itr->first;
+        int parts = width < 180.0 ? 1 : static_cast<int>(std::ceil(width / max_width));
+
+        for (int i = 0; i < parts; ++i)
+            result.push_back(box2d<double>(itr->first + width * i / parts, miny,
+                                           itr->first + width * (i + 1) / parts, maxy));
+    }
+
+    return result;
+}
+
+std::vector<box2d<double> > mongodb_datasource::fan_out(const std::vector<box2d<double> > &boxes) const {
+    if (fanout_ <= 1)
+        return boxes;
+
+    // cut every piece into strips across its longer side
+    std::vector<box2d<double> > strips;
+    for (std::vector<box2d<double> >::const_iterator itr = boxes.begin(); itr != boxes.end(); ++itr) {
+        bool vertical = itr->width() >= itr->height();
+        double step = (vertical ? itr->width() : itr->height()) / fanout_;
+
+        for (int i = 0; i < fanout_; ++i) {
+            if (vertical)
+                strips.push_back(box2d<double>(itr->minx() + step * i, itr->miny(),
+                                               i + 1 == fanout_ ? itr->maxx() : itr->minx() + step * (i + 1), itr->maxy()));
+            else
+                strips.push_back(box2d<double>(itr->minx(), itr->miny() + step * i,
+                                               itr->maxx(), i + 1 == fanout_ ? itr->maxy() : itr->miny() + step * (i + 1)));
+        }
+    }
+
+    return strips;
+}
+
+mongodb_datasource::lod_table mongodb_datasource::parse_lod(const std::string &table) {
+    lod_table result;
+    std::vector<std::string> entries;
+
+    boost::split(entries, table, boost::is_any_of(","));
+    for (std::vector<std::string>::const_iterator itr = entries.begin(); itr != entries.end(); ++itr) {
+        std::string entry = boost::trim_copy(*itr);
+        if (entry.empty())
+            continue;
+
+        std::string::size_type sep = entry.find(':');
+        double scale;
+        if (sep == std::string::npos || !mapnik::util::string2double(entry.substr(0, sep), scale))
+            throw mapnik::datasource_exception("MongoDB Plugin: invalid level of detail entry '" + entry +
+                                               "', expected <min_scale_denominator>:<source>");
+
+        result.push_back(std::make_pair(scale, boost::trim_copy(entry.substr(sep + 1))));
+    }
+
+    std::sort(result.begin(), result.end());
+    std::reverse(result.begin(), result.end());
+    return result;
+}
+
+const boost::shared_ptr<ConnectionPool> &mongodb_datasource::lod_pool(double scale_denominator) const {
+    for (lod_pools::const_iterator itr = collection_lod_.begin(); itr != collection_lod_.end(); ++itr)
+        if (scale_denominator >= itr->first)
+            return itr->second;
+
+    return pool_;
+}
+
+std::string mongodb_datasource::lod_geometry_field(double scale_denominator) const {
+    for (lod_table::const_iterator itr = geometry_lod_.begin(); itr != geometry_lod_.end(); ++itr)
+        if (scale_denominator >= itr->first)
+            return itr->second;
+
+    // the GeoJSON field stays the one queried and indexed
+    return binary_geometry_.empty() ? "geometry" : binary_geometry_;
+}
+
+mongo::BSONObj mongodb_datasource::fields_projection(const std::set<std::string> &names,
+                                                     const std::string &geometry_field) const {
+    mongo::BSONObjBuilder fields;
+
+    fields.append(geometry_field, 1);
+    for (std::set<std::string>::const_iterator itr = names.begin(); itr != names.end(); ++itr)
+        fields.append("properties." + *itr, 1);
+
+    return fields.obj();
+}
+
+std::string mongodb_datasource::cache_key(const ConnectionPool &pool,
+                                          const box2d<double> &env,
+                                          const std::set<std::string> &names,
+                                          const mongodb_decoder::options &opts,
+                                          const std::string &filter,
+                                          const std::string &pipeline) const {
+    std::ostringstream key;
+
+    // the query mode and thinning options pick which documents survive, so
+    // layers differing in them must not share entries; quantize to ~1cm so
+    // float noise in equal extents maps to the same entry
+    key << pool.id() << " " << query_mode_ << " " << opts.geometry_field << " " << opts.tolerance << " "
+        << opts.thin_cell << " " << opts.thin_lines << " " << thin_priority_ << " " << opts.mercator << " "
+        << static_cast<long long>(std::floor(env.minx() * 1e7 + 0.5)) << ","
+        << static_cast<long long>(std::floor(env.miny() * 1e7 + 0.5)) << ","
+        << static_cast<long long>(std::floor(env.maxx() * 1e7 + 0.5)) << ","
+        << static_cast<long long>(std::floor(env.maxy() * 1e7 + 0.5));
+
+    for (std::set<std::string>::const_iterator itr = names.begin(); itr != names.end(); ++itr)
+        key << " " << *itr;
+
+    if (!filter.empty())
+        key << " " << filter;
+
+    if (!pipeline.empty())
+        key << " " << pipeline;
+
+    return key.str();
+}
+
 featureset_ptr mongodb_datasource::features(const query &q) const {
+#ifdef MAPNIK_STATS
+    mapnik::progress_timer __stats__(std::clog, "mongodb_datasource::features");
+#endif
+
+    // decoding works in map units, the database in the stored lon/lat
     const box2d<double> &box = q.get_bbox();
+    box2d<double> env = mercator_ ? mongodb_converter::from_mercator(box) : box;
+    const std::set<std::string> &names = q.property_names();
+    const boost::shared_ptr<ConnectionPool> &pool = lod_pool(q.scale_denominator());
+
+    mongodb_decoder::options opts;
+    opts.extend_context = false;
+    opts.geometry_field = lod_geometry_field(q.scale_denominator());
+    opts.mercator = mercator_;
+    if (simplify_ > 0 && boost::get<0>(q.resolution()) > 0)
+        opts.tolerance = simplify_ / boost::get<0>(q.resolution()); // pixels to map units
+    if (thin_ && thin_size_ > 0 && boost::get<0>(q.resolution()) > 0) {
+        opts.thin_cell = thin_size_ / boost::get<0>(q.resolution());
+        opts.thin_lines = thin_lines_;
+        opts.thin_extent = box;
+    }
+    if (query_mode_ == query_bbox)
+        opts.refine_extent = box;
+
+    // resolution in pixels per stored unit, averaged over the query for mercator
+    double resx = boost::get<0>(q.resolution());
+    double resy = boost::get<1>(q.resolution());
+    if (mercator_ && env.width() > 0 && env.height() > 0) {
+        resx *= box.width() / env.width();
+        resy *= box.height() / env.height();
+    }
+
+    std::string filter = substitute_tokens(filter_, env, q.scale_denominator(),
+                                           resx > 0 ? 1.0 / resx : 0, resy > 0 ? 1.0 / resy : 0);
+    std::string pipeline = aggregation_pipeline(env, names, q.scale_denominator(), resx, resy, filter);
+
+    if (cache_size_ == 0 && !coalesce_)
+        return query_features(pool, env, names, opts, filter, pipeline);
+
+    std::string key = cache_key(*pool, env, names, opts, filter, pipeline);
+    if (cache_size_ > 0) {
+        mongodb_feature_cache::batch_ptr batch = mongodb_feature_cache::instance().find(key);
+        if (batch)
+            return boost::make_shared<mongodb_memory_featureset>(batch);
+    }
+
+    featureset_ptr fs;
+    if (coalesce_) {
+        bool leader;
+        mongodb_flight_ptr flight = mongodb_flight_registry::instance().join(key, leader);
+
+        if (!leader) {
+            MAPNIK_LOG_DEBUG(mongodb) << "mongodb_datasource: joined query in flight for " << pool->id();
+            return boost::make_shared<mongodb_coalesced_featureset>(flight);
+        }
+
+        try {
+            flight->start(query_features(pool, env, names, opts, filter, pipeline));
+        } catch (std::exception &e) {
+            flight->fail(e.what());
+            throw;
+        }
+
+        fs = boost::make_shared<mongodb_coalesced_featureset>(flight);
+    } else
+        fs = query_features(pool, env, names, opts, filter, pipeline);
+
+    if (!fs || cache_size_ == 0)
+        return fs;
 
-    shared_ptr< Pool<Connection, ConnectionCreator> > pool = ConnectionManager::instance().getPool(creator_.id());
+    // only the reader that ran the query records it
+    return boost::make_shared<mongodb_recording_featureset>(fs, key, cache_ttl_, cache_size_);
+}
+
+featureset_ptr mongodb_datasource::query_features(const boost::shared_ptr<ConnectionPool> &pool,
+                                                  const box2d<double> &box,
+                                                  const std::set<std::string> &names,
+                                                  const mongodb_decoder::options &opts,
+                                                  const std::string &filter,
+                                                  const std::string &pipeline) const {
     if (pool) {
+        query_stats stats;
+
+        double start = mapnik::time_now();
         shared_ptr<Connection> conn = pool->borrowObject();
+        stats.pool_wait_ms = (mapnik::time_now() - start) * 1000.0;
 
         if (!conn)
-            return featureset_ptr();
+            throw mapnik::datasource_exception("MongoDB Plugin: no connection available for " +
+                                               pool->creator().namespace_string() + ", the pool is exhausted");
 
         if (conn && conn->isOK()) {
+            query_recorder_ptr recorder = boost::make_shared<query_recorder>(pool->creator().namespace_string(), stats_);
+
             mapnik::context_ptr ctx = boost::make_shared<mapnik::context_type>();
+            for (std::set<std::string>::const_iterator itr = names.begin(); itr != names.end(); ++itr)
+                ctx->push(*itr);
+
+            if (!pipeline.empty()) {
+                if (cluster_)
+                    ctx->push("count");
+
+                start = mapnik::time_now();
+                mongo::BSONObj documents = conn->aggregate(pipeline, max_time_ms_);
+                stats.server_ms = (mapnik::time_now() - start) * 1000.0;
+                recorder->add(stats);
+
+                // pipelines output GeoJSON in "geometry"; the result is
+                // inline, so the connection can go back to the pool now
+                mongodb_decoder::options aggregated = opts;
+                aggregated.geometry_field = "geometry";
+                return boost::make_shared<mongodb_featureset>(shared_ptr<Connection>(), documents, ctx,
+                                                              desc_.get_encoding(), aggregated, recorder);
+            }
 
+            // fetch only the geometry and the attributes requested by styles
+            mongo::BSONObj fields = fields_projection(names, opts.geometry_field);
+
+            std::vector<box2d<double> > boxes = split_bbox(box);
+            if (boxes.size() > 1) {
+                std::vector<std::string> queries;
+                for (std::vector<box2d<double> >::const_iterator itr = boxes.begin(); itr != boxes.end(); ++itr)
+                    queries.push_back(ordered(json_bbox(*itr, filter)));
+
+                // one connection per sub-query, but at most half the pool so
+                // that concurrent renders still get one; the sub-queries
+                // share whatever connections were taken
+                size_t limit = std::min(queries.size(), std::max<size_t>(pool->max_size() / 2, 1));
+                std::vector<shared_ptr<Connection> > conns(1, conn);
+                start = mapnik::time_now();
+                while (conns.size() < limit) {
+                    shared_ptr<Connection> extra = pool->borrowObject();
+                    if (!extra || !extra->isOK())
+                        break;
+                    conns.push_back(extra);
+                }
+                stats.pool_wait_ms += (mapnik::time_now() - start) * 1000.0;
+                recorder->add(stats);
+
+                return boost::make_shared<mongodb_merged_featureset>(conns, queries, fields, batch_size_, max_time_ms_,
+                                                                     ctx, desc_.get_encoding(), opts, prefetch_size_,
+                                                                     recorder);
+            }
 
-            boost::shared_ptr<mongo::DBClientCursor> rs(conn->query(json_bbox(box)));
-            return boost::make_shared<mongodb_featureset>(rs, ctx, desc_.get_encoding());
+            std::string lookup = ordered(json_bbox(boxes[0], filter));
+
+            if (exhaust_) {
+                recorder->add(stats);
+                return boost::make_shared<mongodb_prefetch_featureset>(conn, lookup, fields, max_time_ms_,
+                                                                       ctx, desc_.get_encoding(), opts,
+                                                                       decode_threads_, prefetch_size_, recorder);
+            }
+
+            start = mapnik::time_now();
+            boost::shared_ptr<mongo::DBClientCursor> rs(conn->query(lookup, fields, 0, 0,
+                                                                    batch_size_, max_time_ms_));
+            stats.server_ms = (mapnik::time_now() - start) * 1000.0;
+            recorder->add(stats);
+
+            if (prefetch_)
+                return boost::make_shared<mongodb_prefetch_featureset>(conn, rs, ctx, desc_.get_encoding(), opts,
+                                                                       decode_threads_, prefetch_size_, recorder);
+
+            return boost::make_shared<mongodb_featureset>(conn, rs, ctx, desc_.get_encoding(), opts, recorder);
         }
     }
 
@@ -139,81 +727,244 @@ featureset_ptr mongodb_datasource::features(const query &q) const {
 }
 
 featureset_ptr mongodb_datasource::features_at_point(const coord2d &pt, double tol) const {
-    shared_ptr< Pool<Connection, ConnectionCreator> > pool = ConnectionManager::instance().getPool(creator_.id());
-    if (pool) {
-        shared_ptr<Connection> conn = pool->borrowObject();
+#ifdef MAPNIK_STATS
+    mapnik::progress_timer __stats__(std::clog, "mongodb_datasource::features_at_point");
+#endif
+
+    if (pool_) {
+        shared_ptr<Connection> conn = pool_->borrowObject();
 
         if (!conn)
-            return featureset_ptr();
+            throw mapnik::datasource_exception("MongoDB Plugin: no connection available for " +
+                                               pool_->creator().namespace_string() + ", the pool is exhausted");
 
         if (conn->isOK()) {
             mapnik::context_ptr ctx = boost::make_shared<mapnik::context_type>();
 
             box2d<double> box(pt.x - tol, pt.y - tol, pt.x + tol, pt.y + tol);
-            boost::shared_ptr<mongo::DBClientCursor> rs(conn->query(json_bbox(box)));
-            return boost::make_shared<mongodb_featureset>(rs, ctx, desc_.get_encoding());
+            box2d<double> env = mercator_ ? mongodb_converter::from_mercator(box) : box;
+            std::string filter = substitute_tokens(filter_, env, 0, 0, 0);
+
+            // closest first, so a limit stops the cursor after the best hits
+            std::string lookup = query_mode_ == query_bbox
+                ? json_bbox(env, filter) : json_near(env.center(), env.height() / 2, filter);
+
+            // the legacy $near of a 2d index stops at 100 documents unless
+            // the query carries a limit of its own
+            static const int near_2d_limit = 1000000;
+            int limit = point_limit_ == 0 && query_mode_ == query_2d ? near_2d_limit : point_limit_;
+            boost::shared_ptr<mongo::DBClientCursor> rs(conn->query(lookup, mongo::BSONObj(), limit, 0,
+                                                                    batch_size_, max_time_ms_));
+
+            mongodb_decoder::options opts;
+            opts.mercator = mercator_;
+            if (query_mode_ == query_bbox)
+                opts.refine_extent = box;
+
+            return boost::make_shared<mongodb_featureset>(conn, rs, ctx, desc_.get_encoding(), opts);
         }
     }
 
     return featureset_ptr();
 }
 
+bool mongodb_datasource::compute_extent(Connection &conn, box2d<double> &ext) const {
+    std::string metadata_ns = conn.database() + "." + metadata_collection_;
+    bool initialized = false;
+
+    if (persist_extent_) {
+        mongo::BSONObj doc = conn.findOne(metadata_ns, BSON("_id" << conn.ns()));
+        mongo::BSONElement stored = doc["extent"];
+
+        if (stored.type() == mongo::Array) {
+            std::vector<mongo::BSONElement> coords = stored.Array();
+            if (coords.size() == 4) {
+                ext.init(coords[0].Number(), coords[1].Number(), coords[2].Number(), coords[3].Number());
+                return true;
+            }
+        }
+    }
+
+    // find each side with spatial index probes rather than reading any
+    // coordinates, so the cost doesn't grow with the collection
+    if (any_within(conn, box2d<double>(-180.0, -90.0, 180.0, 90.0))) {
+        ext.init(probe_bound(conn, 0), probe_bound(conn, 1), probe_bound(conn, 2), probe_bound(conn, 3));
+        initialized = true;
+    }
+
+    if (initialized && persist_extent_)
+        conn.upsert(metadata_ns, BSON("_id" << conn.ns()),
+                    BSON("$set" << BSON("extent" << BSON_ARRAY(ext.minx() << ext.miny() << ext.maxx() << ext.maxy()))));
+
+    return initialized;
+}
+
+bool mongodb_datasource::any_within(Connection &conn, const box2d<double> &env) const {
+    boost::shared_ptr<mongo::DBClientCursor> rs(conn.query(json_boxes(hemispheres(env)), BSON("_id" << 1), 1,
+                                                           0, 0, max_time_ms_));
+    try {
+        return rs->more();
+    } catch(mongo::DBException &de) {
+        std::string err_msg = "Mongodb Plugin: ";
+        err_msg += de.toString();
+        err_msg += "\n";
+        throw mapnik::datasource_exception(err_msg);
+    }
+}
+
+double mongodb_datasource::probe_bound(Connection &conn, int side) const {
+    // side is minx, miny, maxx, maxy in that order; [lo, hi] brackets the
+    // bound and the outer end is returned, so the extent never cuts data
+    bool x = side % 2 == 0, lower = side < 2;
+    double lo = x ? -180.0 : -90.0, hi = x ? 180.0 : 90.0;
+
+    while (hi - lo > extent_precision_) {
+        double mid = (lo + hi) / 2;
+        box2d<double> probe(-180.0, -90.0, 180.0, 90.0);
+
+        if (x && lower)
+            probe.set_maxx(mid);
+        else if (x)
+            probe.set_minx(mid);
+        else if (lower)
+            probe.set_maxy(mid);
+        else
+            probe.set_miny(mid);
+
+        if (any_within(conn, probe) == lower)
+            hi = mid;
+        else
+            lo = mid;
+    }
+
+    return lower ? lo : hi;
+}
+
 box2d<double> mongodb_datasource::envelope() const {
+    box2d<double> ext = stored_envelope();
+
+    return mercator_ ? mongodb_converter::to_mercator(ext) : ext;
+}
+
+box2d<double> mongodb_datasource::stored_envelope() const {
+    // concurrent first renders wait for a single computation
+    boost::mutex::scoped_lock lock(extent_mutex_);
+
     if (extent_initialized_)
         return extent_;
-    else {
-        // a dumb way :-/
-        extent_.init(-180.0, -90.0, 180.0, 90.0);
+
+    boost::optional<box2d<double> > cached = mongodb_metadata_cache::instance().extent(creator_.id());
+    if (cached) {
+        extent_ = *cached;
         extent_initialized_ = true;
+        return extent_;
     }
 
-    // shared_ptr< Pool<Connection, ConnectionCreator> > pool = ConnectionManager::instance().getPool(creator_.id());
-    // if (pool) {
-    //     shared_ptr<Connection> conn = pool->borrowObject();
+    if (estimate_extent_) {
+        if (pool_) {
+            shared_ptr<Connection> conn = pool_->borrowObject();
 
-    //     if (!conn)
-    //         return extent_;
+            box2d<double> ext;
+            if (conn && conn->isOK() && compute_extent(*conn, ext)) {
+                mongodb_metadata_cache::instance().set_extent(creator_.id(), ext);
+                extent_ = ext;
+                extent_initialized_ = true;
+                return extent_;
+            }
+        }
+    }
 
-    //     if (conn->isOK()) {
-    //         // query
-    //     }
-    // }
+    // nothing better known, assume the whole world
+    extent_.init(-180.0, -90.0, 180.0, 90.0);
+    extent_initialized_ = true;
 
     return extent_;
 }
 
-boost::optional<mapnik::datasource::geometry_t> mongodb_datasource::get_geometry_type() const {
-    boost::optional<mapnik::datasource::geometry_t> result;
-
-    shared_ptr< Pool<Connection,ConnectionCreator> > pool = ConnectionManager::instance().getPool(creator_.id());
-    if (pool) {
-        shared_ptr<Connection> conn = pool->borrowObject();
+mongodb_schema mongodb_datasource::sample_schema(Connection &conn) const {
+    mongodb_schema schema;
+    std::map<std::string, size_t> seen;
+
+    try {
+        boost::shared_ptr<mongo::DBClientCursor> rs(conn.query("{ geometry: { \"$exists\": true } }",
+                                                               BSON("geometry.type" << 1 << "properties" << 1),
+                                                               schema_sample_size_));
+        while (rs->more()) {
+            mongo::BSONObj bson = rs->nextSafe();
+            mongo::BSONElement type = bson["geometry"]["type"];
+
+            if (type.type() == mongo::String) {
+                std::string name = type.String();
+                boost::optional<mapnik::datasource::geometry_t> gtype;
+
+                if (name == "Point")
+                    gtype.reset(mapnik::datasource::Point);
+                else if (name == "LineString")
+                    gtype.reset(mapnik::datasource::LineString);
+                else if (name == "Polygon")
+                    gtype.reset(mapnik::datasource::Polygon);
+
+                if (gtype && !schema.geometry_type)
+                    schema.geometry_type = gtype;
+                else if (gtype && *gtype != *schema.geometry_type)
+                    schema.geometry_type.reset(mapnik::datasource::Collection);
+            }
 
-        if (!conn)
-            return result;
+            mongo::BSONElement prop = bson["properties"];
+            if (prop.type() != mongo::Object)
+                continue;
+
+            for (mongo::BSONObjIterator i(prop.embeddedObject()); i.more(); ) {
+                mongo::BSONElement e = i.next();
+                mapnik::eAttributeType atype;
+
+                // mirrors the types produced by mongodb_decoder
+                switch (e.type()) {
+                case mongo::NumberDouble:
+                    atype = mapnik::Double;
+                    break;
+                case mongo::NumberInt:
+                case mongo::NumberLong:
+                case mongo::Date:
+                    atype = mapnik::Integer;
+                    break;
+                case mongo::Bool:
+                    atype = mapnik::Boolean;
+                    break;
+                case mongo::String:
+                case mongo::jstOID:
+                case mongo::Object:
+                case mongo::Array:
+                    atype = mapnik::String;
+                    break;
+                default:
+                    continue;
+                }
 
-        if (conn->isOK()) {
-            boost::shared_ptr <mongo::DBClientCursor> rs(conn->query("{ geometry: { \"$exists\": true } }", 1));
-            try {
-                if (rs->more()) {
-                    mongo::BSONObj bson = rs->next();
-                    std::string type = bson["geometry"]["type"].String();
-
-                    if (type == "Point")
-                        result.reset(mapnik::datasource::Point);
-                    else if (type == "LineString")
-                        result.reset(mapnik::datasource::LineString);
-                    else if (type == "Polygon")
-                        result.reset(mapnik::datasource::Polygon);
+                std::map<std::string, size_t>::const_iterator itr = seen.find(e.fieldName());
+                if (itr == seen.end()) {
+                    seen[e.fieldName()] = schema.attributes.size();
+                    schema.attributes.push_back(attribute_descriptor(e.fieldName(), atype));
+                } else if (schema.attributes[itr->second].get_type() == mapnik::Integer && atype == mapnik::Double) {
+                    // integers and doubles in the same attribute widen to double
+                    schema.attributes[itr->second] = attribute_descriptor(e.fieldName(), mapnik::Double);
                 }
-            } catch(mongo::DBException &de) {
-                std::string err_msg = "Mongodb Plugin: ";
-                err_msg += de.toString();
-                err_msg += "\n";
-                throw mapnik::datasource_exception(err_msg);
             }
         }
+    } catch(mongo::DBException &de) {
+        std::string err_msg = "Mongodb Plugin: ";
+        err_msg += de.toString();
+        err_msg += "\n";
+        throw mapnik::datasource_exception(err_msg);
     }
 
-    return result;
+    return schema;
+}
+
+boost::optional<mapnik::datasource::geometry_t> mongodb_datasource::get_geometry_type() const {
+    return geometry_type_;
+}
+
+query_stats mongodb_datasource::statistics() const {
+    return stats_->totals();
 }
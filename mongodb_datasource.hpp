@@ -39,12 +39,19 @@
 #include <boost/optional.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 // stl
 #include <vector>
 #include <string>
+#include <set>
+#include <ctime>
+#include <utility>
 
 #include "connection_manager.hpp"
+#include "mongodb_decoder.hpp"
+#include "mongodb_stats.hpp"
+#include "mongodb_metadata_cache.hpp"
 
 using mapnik::transcoder;
 using mapnik::datasource;
@@ -57,17 +64,96 @@ using mapnik::parameters;
 using mapnik::coord2d;
 
 class mongodb_datasource : public datasource {
+    enum query_mode_t {
+        query_2dsphere, // $geoIntersects on a 2dsphere index
+        query_2d,       // $geoWithin/$box on a legacy 2d index
+        query_bbox      // ranges on bbox.* fields, refined on the client
+    };
+
+    // scale denominator -> source, largest scale first
+    typedef std::vector<std::pair<double, std::string> > lod_table;
+    typedef std::vector<std::pair<double, boost::shared_ptr<ConnectionPool> > > lod_pools;
+
     const std::string uri_;
     const std::string username_;
     const std::string password_;
     layer_descriptor desc_;
     mapnik::datasource::datasource_t type_;
     ConnectionCreator<Connection> creator_;
+    boost::shared_ptr<ConnectionPool> pool_;
     bool persist_connection_;
+    bool prefetch_;
+    size_t decode_threads_;
+    size_t prefetch_size_;
+    int batch_size_;
+    bool exhaust_;
+    int max_time_ms_;
+    int fanout_;
+    size_t cache_size_;
+    std::time_t cache_ttl_;
+    bool coalesce_;
+    bool estimate_extent_;
+    double extent_precision_;
+    bool persist_extent_;
+    std::string metadata_collection_;
+    std::string binary_geometry_;
+    lod_table geometry_lod_;
+    lod_pools collection_lod_;
+    double simplify_;
+    mongodb_stats_ptr stats_;
+    int schema_sample_size_;
+    std::string filter_;
+    query_mode_t query_mode_;
+    int point_limit_;
+    std::string pipeline_;
+    bool cluster_;
+    int cluster_size_;
+    double aggregate_min_scale_;
+    bool thin_;
+    double thin_size_;
+    bool thin_lines_;
+    std::string thin_priority_;
+    bool mercator_;
+    boost::optional<mapnik::datasource::geometry_t> geometry_type_;
     mutable bool extent_initialized_;
     mutable mapnik::box2d<double> extent_;
+    mutable boost::mutex extent_mutex_;
 
-    std::string json_bbox(const box2d<double> &env) const;
+    std::string json_bbox(const box2d<double> &env, const std::string &filter = std::string()) const;
+    std::string json_near(const coord2d &pt, double tol, const std::string &filter) const;
+    std::string substitute_tokens(const std::string &text, const box2d<double> &env, double scale_denominator,
+                                  double pixel_width, double pixel_height) const;
+    std::string grid_pipeline(const std::set<std::string> &names) const;
+    std::string aggregation_pipeline(const box2d<double> &env, const std::set<std::string> &names,
+                                     double scale_denominator, double resx, double resy,
+                                     const std::string &filter) const;
+    std::string json_boxes(const std::vector<box2d<double> > &boxes, const std::string &filter = std::string()) const;
+    std::vector<box2d<double> > split_bbox(const box2d<double> &env) const;
+    std::vector<box2d<double> > hemispheres(const box2d<double> &env) const;
+    std::vector<box2d<double> > fan_out(const std::vector<box2d<double> > &boxes) const;
+    std::string ordered(const std::string &query) const;
+    static lod_table parse_lod(const std::string &table);
+    const boost::shared_ptr<ConnectionPool> &lod_pool(double scale_denominator) const;
+    std::string lod_geometry_field(double scale_denominator) const;
+
+    mongo::BSONObj fields_projection(const std::set<std::string> &names, const std::string &geometry_field) const;
+    std::string cache_key(const ConnectionPool &pool,
+                          const box2d<double> &env,
+                          const std::set<std::string> &names,
+                          const mongodb_decoder::options &opts,
+                          const std::string &filter,
+                          const std::string &pipeline) const;
+    bool compute_extent(Connection &conn, box2d<double> &ext) const;
+    bool any_within(Connection &conn, const box2d<double> &env) const;
+    double probe_bound(Connection &conn, int side) const;
+    box2d<double> stored_envelope() const;
+    mongodb_schema sample_schema(Connection &conn) const;
+    featureset_ptr query_features(const boost::shared_ptr<ConnectionPool> &pool,
+                                  const box2d<double> &env,
+                                  const std::set<std::string> &names,
+                                  const mongodb_decoder::options &opts,
+                                  const std::string &filter,
+                                  const std::string &pipeline) const;
 
 public:
     mongodb_datasource(const parameters &params);
@@ -82,6 +168,9 @@ public:
     mapnik::box2d<double> envelope() const;
 
     boost::optional<mapnik::datasource::geometry_t> get_geometry_type() const;
+
+    // totals over all queries run by this datasource
+    query_stats statistics() const;
 };
 
 #endif // MONGODB_DATASOURCE_HPP
@@ -0,0 +1,253 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// mapnik
+#include <mapnik/debug.hpp>
+#include <mapnik/timer.hpp>
+#include <mapnik/value_types.hpp>
+
+// boost
+#include <boost/functional/hash.hpp>
+#include <boost/make_shared.hpp>
+
+// stl
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "mongodb_decoder.hpp"
+#include "mongodb_converter.hpp"
+
+using mapnik::feature_ptr;
+using mapnik::context_ptr;
+using mapnik::transcoder;
+
+namespace {
+
+const size_t interned_slots = 1024; // power of two
+const int interned_max_length = 64;
+const int thin_max_cells = 8192; // per side, bounds the bitmap to 8MB
+const size_t no_cell = static_cast<size_t>(-1); // not subject to thinning
+
+}
+
+mongodb_decoder::mongodb_decoder(const context_ptr &ctx, const std::string &encoding, const options &opts)
+    : ctx_(ctx),
+      tr_(new transcoder(encoding)),
+      options_(opts),
+      strings_(interned_slots),
+      arena_(opts.arena ? boost::make_shared<mongodb_arena>() : mongodb_arena_ptr()),
+      cell_(0.0),
+      cols_(0),
+      rows_(0) {
+    const mapnik::box2d<double> &ext = options_.thin_extent;
+
+    if (options_.thin_cell > 0 && ext.width() > 0 && ext.height() > 0) {
+        cell_ = std::max(options_.thin_cell,
+                         std::max(ext.width(), ext.height()) / thin_max_cells);
+        cols_ = static_cast<int>(std::ceil(ext.width() / cell_));
+        rows_ = static_cast<int>(std::ceil(ext.height() / cell_));
+        occupied_.resize(static_cast<size_t>(cols_) * rows_);
+    }
+}
+
+mongodb_decoder::~mongodb_decoder() {
+}
+
+const mongodb_decoder::field &mongodb_decoder::resolve(const char *name, size_t pos, const mapnik::feature_impl &feature) {
+    // documents of a collection mostly list their attributes in the same
+    // order; this saves the name copy and the has_key() test per value, the
+    // context lookup by name in put() remains
+    if (pos < fields_.size() && fields_[pos].name == name)
+        return fields_[pos];
+
+    for (std::vector<field>::const_iterator itr = fields_.begin(); itr != fields_.end(); ++itr)
+        if (itr->name == name)
+            return *itr;
+
+    field f;
+    f.name = name;
+    f.known = options_.extend_context || feature.has_key(f.name);
+    fields_.push_back(f);
+
+    return fields_.back();
+}
+
+mapnik::value_unicode_string mongodb_decoder::intern(const char *data, int length) {
+    if (length > interned_max_length)
+        return tr_->transcode(data, length);
+
+    interned &slot = strings_[boost::hash_range(data, data + length) & (interned_slots - 1)];
+
+    if (!slot.used || slot.raw.size() != static_cast<size_t>(length) ||
+        std::memcmp(slot.raw.data(), data, length) != 0) {
+        slot.raw.assign(data, length);
+        slot.value = tr_->transcode(data, length);
+        slot.used = true;
+    }
+
+    return slot.value;
+}
+
+bool mongodb_decoder::occupied(const mongo::BSONElement &geom, size_t &cell) const {
+    cell = no_cell;
+    if (occupied_.empty())
+        return false;
+
+    bool point = mongodb_converter::is_point(geom);
+    if (!point && !options_.thin_lines)
+        return false;
+
+    mapnik::box2d<double> ext;
+    bool initialized = false;
+    mongodb_converter::expand_envelope(geom, ext, initialized);
+    if (initialized && options_.mercator)
+        ext = mongodb_converter::to_mercator(ext);
+
+    // anything larger than a cell covers pixels of its own
+    if (!initialized || (!point && (ext.width() > cell_ || ext.height() > cell_)))
+        return false;
+
+    mapnik::coord2d c = ext.center();
+    int col = static_cast<int>(std::floor((c.x - options_.thin_extent.minx()) / cell_));
+    int row = static_cast<int>(std::floor((c.y - options_.thin_extent.miny()) / cell_));
+    if (col < 0 || col >= cols_ || row < 0 || row >= rows_)
+        return false;
+
+    cell = static_cast<size_t>(row) * cols_ + col;
+    return occupied_[cell];
+}
+
+void mongodb_decoder::occupy(size_t cell) {
+    if (cell != no_cell)
+        occupied_[cell] = true;
+}
+
+void mongodb_decoder::put(mapnik::feature_impl &feature, const std::string &name, const mongo::BSONElement &e) {
+    switch (e.type()) {
+    case mongo::String:
+        put(feature, name, intern(e.valuestr(), e.valuestrsize() - 1));
+        break;
+
+    case mongo::NumberDouble:
+        put(feature, name, e._numberDouble());
+        break;
+
+    case mongo::NumberLong:
+        put(feature, name, static_cast<mapnik::value_integer>(e._numberLong()));
+        break;
+
+    case mongo::NumberInt:
+        put(feature, name, static_cast<mapnik::value_integer>(e._numberInt()));
+        break;
+
+    case mongo::Bool:
+        put(feature, name, e.boolean());
+        break;
+
+    case mongo::Date: // milliseconds since the epoch
+        put(feature, name, static_cast<mapnik::value_integer>(e.date().millis));
+        break;
+
+    case mongo::jstOID:
+        put(feature, name, tr_->transcode(e.__oid().str().c_str()));
+        break;
+
+    case mongo::Object:
+    case mongo::Array: {
+        std::string json = e.jsonString(mongo::Strict, false);
+        put(feature, name, tr_->transcode(json.data(), json.size()));
+        break;
+    }
+
+    case mongo::jstNULL:
+    case mongo::Undefined:
+        put(feature, name, mapnik::value_null());
+        break;
+
+    default: // binary, regex, code, timestamps... have no mapnik counterpart
+        break;
+    }
+}
+
+feature_ptr mongodb_decoder::decode(const mongo::BSONObj &bson, mapnik::value_integer id) {
+    mongo::BSONElement geom = bson.getField(options_.geometry_field);
+
+    // decided on the raw geometry, before anything is allocated
+    size_t cell;
+    if (occupied(geom, cell))
+        return feature_ptr();
+
+    // one allocation for the feature and its reference count, from the
+    // decoder's pool instead of the contended global heap
+    feature_ptr feature = arena_
+        ? boost::allocate_shared<mapnik::feature_impl>(arena_allocator<mapnik::feature_impl>(arena_), ctx_, id)
+        : feature_ptr(new mapnik::Feature(ctx_, id));
+    mongo::BSONElement prop = bson["properties"];
+
+    if (!mongodb_converter::decode_geometry(geom, feature, options_.tolerance,
+                                            options_.mercator ? &projected_ : 0))
+        return feature_ptr();
+
+    if (options_.refine_extent.valid()) {
+        bool hit = false;
+        for (unsigned i = 0; i < feature->num_geometries() && !hit; ++i)
+            hit = mongodb_converter::intersects(feature->get_geometry(i), options_.refine_extent);
+
+        if (!hit)
+            return feature_ptr();
+    }
+
+    if (prop.type() == mongo::Object) {
+        size_t pos = 0;
+
+        for (mongo::BSONObjIterator i(prop.embeddedObject()); i.more(); ++pos) {
+            mongo::BSONElement e = i.next();
+            const field &f = resolve(e.fieldName(), pos, *feature);
+
+            if (f.known)
+                put(*feature, f.name, e);
+        }
+    }
+
+    occupy(cell);
+    return feature;
+}
+
+feature_ptr mongodb_decoder::decode(const mongo::BSONObj &bson, mapnik::value_integer id, query_stats &stats) {
+    double start = mapnik::time_now();
+    feature_ptr feature = decode(bson, id);
+    stats.decode_ms += (mapnik::time_now() - start) * 1000.0;
+
+    ++stats.documents;
+    stats.bytes += bson.objsize();
+
+    if (feature) {
+        ++stats.features;
+        for (unsigned i = 0; i < feature->num_geometries(); ++i)
+            stats.vertices += feature->get_geometry(i).size();
+    }
+
+    return feature;
+}
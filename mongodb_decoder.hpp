@@ -0,0 +1,128 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_DECODER_HPP
+#define MONGODB_DECODER_HPP
+
+// mapnik
+#include <mapnik/feature.hpp>
+#include <mapnik/unicode.hpp>
+#include <mapnik/box2d.hpp>
+
+// mongo
+#include <mongo/client/dbclientcursor.h>
+
+// boost
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+// stl
+#include <string>
+#include <vector>
+
+#include "mongodb_stats.hpp"
+#include "mongodb_arena.hpp"
+
+// Turns a BSON document into a mapnik feature. One instance per thread:
+// the transcoder is not thread-safe. When extend_context is false the
+// context is treated as read-only and unknown attributes are skipped,
+// which makes it safe to share the context between decoding threads.
+class mongodb_decoder : private boost::noncopyable {
+public:
+    struct options {
+        bool extend_context;
+        std::string geometry_field;
+        double tolerance; // drop vertices closer than this to the previous one
+        // > 0 drops points landing on a cell of this size (in map units)
+        // within thin_extent that an earlier feature already occupies
+        double thin_cell;
+        bool thin_lines; // thin lines and polygons smaller than a cell too
+        mapnik::box2d<double> thin_extent;
+        bool arena; // allocate features from a pool owned by the decoder
+        // when valid, drops features whose geometry doesn't intersect it
+        mapnik::box2d<double> refine_extent;
+        // emit spherical mercator instead of the stored lon/lat; tolerance,
+        // thinning and refinement are then given in mercator too
+        bool mercator;
+
+        options()
+            : extend_context(true), geometry_field("geometry"), tolerance(0.0),
+              thin_cell(0.0), thin_lines(false), arena(true), mercator(false) {}
+    };
+
+private:
+    // attribute name checked against the context once per decoder. Only
+    // whether the context knows it is cached: feature_impl has no setter by
+    // index, so every value still goes through put(name), one map lookup
+    struct field {
+        std::string name;
+        bool known;
+    };
+
+    // direct-mapped cache of transcoded string values
+    struct interned {
+        std::string raw;
+        mapnik::value_unicode_string value;
+        bool used;
+
+        interned() : used(false) {}
+    };
+
+    mapnik::context_ptr ctx_;
+    boost::scoped_ptr<mapnik::transcoder> tr_;
+    options options_;
+    std::vector<field> fields_;
+    std::vector<interned> strings_;
+    mongodb_arena_ptr arena_;
+    std::vector<bool> occupied_;
+    double cell_;
+    int cols_;
+    int rows_;
+    std::vector<double> projected_; // scratch ring for the mercator kernel
+
+    const field &resolve(const char *name, size_t pos, const mapnik::feature_impl &feature);
+    mapnik::value_unicode_string intern(const char *data, int length);
+    // thinning is checked before decoding but the cell is only taken once
+    // the feature is actually returned
+    bool occupied(const mongo::BSONElement &geom, size_t &cell) const;
+    void occupy(size_t cell);
+    void put(mapnik::feature_impl &feature, const std::string &name, const mongo::BSONElement &e);
+
+    template <typename T>
+    void put(mapnik::feature_impl &feature, const std::string &name, const T &value) {
+        if (options_.extend_context)
+            feature.put_new(name, value);
+        else
+            feature.put(name, value);
+    }
+
+public:
+    mongodb_decoder(const mapnik::context_ptr &ctx, const std::string &encoding, const options &opts);
+    ~mongodb_decoder();
+
+    mapnik::feature_ptr decode(const mongo::BSONObj &bson, mapnik::value_integer id);
+    // same, accounting the document, decode time and output in stats
+    mapnik::feature_ptr decode(const mongo::BSONObj &bson, mapnik::value_integer id, query_stats &stats);
+};
+
+#endif // MONGODB_DECODER_HPP
@@ -0,0 +1,162 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// mapnik
+#include <mapnik/geometry.hpp>
+#include <mapnik/value.hpp>
+#include <mapnik/vertex.hpp>
+#include <mapnik/feature_factory.hpp>
+#include <mapnik/feature_kv_iterator.hpp>
+
+// stl
+#include <memory>
+
+#include "mongodb_feature_cache.hpp"
+
+mongodb_feature_cache::mongodb_feature_cache()
+    : capacity_(0) {
+    stats_.hits = stats_.misses = stats_.insertions = 0;
+    stats_.evictions = stats_.expirations = 0;
+    stats_.entries = stats_.bytes = stats_.capacity = 0;
+}
+
+void mongodb_feature_cache::reserve(size_t bytes) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (bytes > capacity_)
+        capacity_ = bytes;
+}
+
+void mongodb_feature_cache::erase(ListType::iterator itr) {
+    stats_.bytes -= itr->bytes;
+    index_.erase(itr->key);
+    lru_.erase(itr);
+}
+
+void mongodb_feature_cache::shrink() {
+    while (stats_.bytes > capacity_ && !lru_.empty()) {
+        erase(--lru_.end());
+        ++stats_.evictions;
+    }
+}
+
+mongodb_feature_cache::batch_ptr mongodb_feature_cache::find(const std::string &key) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    IndexType::iterator itr = index_.find(key);
+    if (itr == index_.end()) {
+        ++stats_.misses;
+        return batch_ptr();
+    }
+
+    ListType::iterator pos = itr->second;
+    if (pos->expires != 0 && pos->expires <= std::time(0)) {
+        erase(pos);
+        ++stats_.expirations;
+        ++stats_.misses;
+        return batch_ptr();
+    }
+
+    lru_.splice(lru_.begin(), lru_, pos);
+    ++stats_.hits;
+    return pos->batch;
+}
+
+void mongodb_feature_cache::insert(const std::string &key, const batch_ptr &batch, size_t bytes, std::time_t ttl) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (bytes > capacity_)
+        return;
+
+    IndexType::iterator itr = index_.find(key);
+    if (itr != index_.end())
+        erase(itr->second);
+
+    entry e;
+    e.key = key;
+    e.batch = batch;
+    e.bytes = bytes;
+    e.expires = ttl > 0 ? std::time(0) + ttl : 0;
+
+    lru_.push_front(e);
+    index_[key] = lru_.begin();
+    stats_.bytes += bytes;
+    ++stats_.insertions;
+
+    shrink();
+}
+
+void mongodb_feature_cache::clear() {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    lru_.clear();
+    index_.clear();
+    stats_.bytes = 0;
+}
+
+mongodb_feature_cache::stats mongodb_feature_cache::get_stats() {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    stats result = stats_;
+    result.entries = lru_.size();
+    result.capacity = capacity_;
+    return result;
+}
+
+size_t mongodb_feature_cache::estimate_size(const mapnik::feature_ptr &feature) {
+    size_t bytes = sizeof(mapnik::Feature) + feature->size() * sizeof(mapnik::value);
+
+    for (unsigned i = 0; i < feature->num_geometries(); ++i)
+        bytes += sizeof(mapnik::geometry_type) +
+                 feature->get_geometry(i).size() * (2 * sizeof(double) + sizeof(unsigned char));
+
+    return bytes;
+}
+
+mapnik::feature_ptr mongodb_feature_cache::copy(const mapnik::feature_ptr &feature) {
+    mapnik::feature_ptr result(mapnik::feature_factory::create(feature->context(), feature->id()));
+
+    for (mapnik::feature_kv_iterator itr = feature->begin(); itr != feature->end(); ++itr)
+        result->put(boost::get<0>(*itr), boost::get<1>(*itr));
+
+    for (unsigned i = 0; i < feature->num_geometries(); ++i) {
+        const mapnik::geometry_type &geom = feature->get_geometry(i);
+        std::auto_ptr<mapnik::geometry_type> path(new mapnik::geometry_type(geom.type()));
+        double x, y;
+
+        for (unsigned v = 0; v < geom.size(); ++v) {
+            unsigned cmd = geom.vertex(v, &x, &y);
+
+            if (cmd == mapnik::SEG_MOVETO)
+                path->move_to(x, y);
+            else if (cmd == mapnik::SEG_CLOSE)
+                path->close_path();
+            else
+                path->line_to(x, y);
+        }
+
+        result->paths().push_back(path);
+    }
+
+    return result;
+}
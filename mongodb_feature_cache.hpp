@@ -0,0 +1,109 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_FEATURE_CACHE_HPP
+#define MONGODB_FEATURE_CACHE_HPP
+
+// mapnik
+#include <mapnik/feature.hpp>
+#include <mapnik/utils.hpp>
+
+// boost
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+// stl
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <ctime>
+
+using mapnik::singleton;
+using mapnik::CreateStatic;
+
+// Process-wide LRU cache of decoded feature batches, bounded by an estimate
+// of their memory footprint. Shared by every mongodb datasource instance.
+class mongodb_feature_cache : public singleton<mongodb_feature_cache, CreateStatic> {
+    friend class CreateStatic<mongodb_feature_cache>;
+
+public:
+    typedef std::vector<mapnik::feature_ptr> batch_type;
+    typedef boost::shared_ptr<const batch_type> batch_ptr;
+
+    struct stats {
+        size_t hits;
+        size_t misses;
+        size_t insertions;
+        size_t evictions;
+        size_t expirations;
+        size_t entries;
+        size_t bytes;
+        size_t capacity;
+    };
+
+private:
+    struct entry {
+        std::string key;
+        batch_ptr batch;
+        size_t bytes;
+        std::time_t expires; // 0 means never
+    };
+
+    typedef std::list<entry> ListType;
+    typedef std::map<std::string, ListType::iterator> IndexType;
+
+    ListType lru_; // most recently used first
+    IndexType index_;
+    size_t capacity_;
+    stats stats_;
+    boost::mutex mutex_;
+
+    void erase(ListType::iterator itr);
+    void shrink();
+
+public:
+    mongodb_feature_cache();
+
+    // grows the byte budget, the largest request among datasources wins
+    void reserve(size_t bytes);
+
+    batch_ptr find(const std::string &key);
+    void insert(const std::string &key, const batch_ptr &batch, size_t bytes, std::time_t ttl);
+    void clear();
+
+    stats get_stats();
+
+    static size_t estimate_size(const mapnik::feature_ptr &feature);
+
+    // A private deep copy for one reader. geometry_type walks its vertices
+    // with a mutable iterator, so a feature must never be rendered by two
+    // threads at once; batches are only ever read through vertex(pos).
+    static mapnik::feature_ptr copy(const mapnik::feature_ptr &feature);
+
+private:
+    mongodb_feature_cache(const mongodb_feature_cache&);
+    mongodb_feature_cache &operator=(const mongodb_feature_cache);
+};
+
+#endif // MONGODB_FEATURE_CACHE_HPP
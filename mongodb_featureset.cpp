@@ -32,6 +32,7 @@
 #include <mapnik/util/conversions.hpp>
 #include <mapnik/util/trim.hpp>
 #include <mapnik/global.hpp> // for int2net
+#include <mapnik/timer.hpp>
 
 
 // boost
@@ -46,7 +47,6 @@
 #include <string>
 
 #include "mongodb_featureset.hpp"
-#include "mongodb_converter.hpp"
 
 using mapnik::geometry_type;
 using mapnik::byte;
@@ -54,66 +54,70 @@ using mapnik::geometry_utils;
 using mapnik::feature_factory;
 using mapnik::context_ptr;
 
-mongodb_featureset::mongodb_featureset(const boost::shared_ptr<mongo::DBClientCursor> &rs,
+mongodb_featureset::mongodb_featureset(const boost::shared_ptr<Connection> &conn,
+                                       const boost::shared_ptr<mongo::DBClientCursor> &rs,
                                        const context_ptr &ctx,
-                                       const std::string &encoding)
-    : rs_(rs),
-      ctx_(ctx),
-      tr_(new transcoder(encoding)),
-      feature_id_(0) {
+                                       const std::string &encoding,
+                                       const mongodb_decoder::options &opts,
+                                       const query_recorder_ptr &recorder)
+    : conn_(conn),
+      rs_(rs),
+      decoder_(ctx, encoding, opts),
+      feature_id_(0),
+      recorder_(recorder) {
+}
+
+mongodb_featureset::mongodb_featureset(const boost::shared_ptr<Connection> &conn,
+                                       const mongo::BSONObj &documents,
+                                       const context_ptr &ctx,
+                                       const std::string &encoding,
+                                       const mongodb_decoder::options &opts,
+                                       const query_recorder_ptr &recorder)
+    : conn_(conn),
+      documents_(documents),
+      itr_(new mongo::BSONObjIterator(documents_)),
+      decoder_(ctx, encoding, opts),
+      feature_id_(0),
+      recorder_(recorder) {
 }
 
 mongodb_featureset::~mongodb_featureset() {
+    if (recorder_)
+        recorder_->add(stats_);
 }
 
 feature_ptr mongodb_featureset::next() {
-    while (rs_->more()) {
-        mapnik::feature_ptr feature(new mapnik::Feature(ctx_, feature_id_));
+    for (;;) {
+        feature_ptr feature;
 
         try {
-            mongo::BSONObj bson = rs_->nextSafe();
-            mongo::BSONElement geom = bson["geometry"];
-            mongo::BSONElement prop = bson["properties"];
-
-            if (geom.type() != mongo::Object)
-                continue;
-
-            mongodb_converter::convert_geometry(bson["geometry"], feature);
-
-            if (prop.type() == mongo::Object)
-                for (mongo::BSONObjIterator i = prop.Obj().begin(); i.more(); ) {
-                    mongo::BSONElement e = i.next();
-                    std::string name(e.fieldName());
-
-                    switch (e.type()) {
-                    case mongo::String:
-                        feature->put_new(name, tr_->transcode(e.String().c_str()));
-                        break;
-
-                    case mongo::NumberDouble:
-                        feature->put_new(name, e.Double());
-                        break;
-
-                    case mongo::NumberLong:
-                        feature->put_new<mapnik::value_integer>(name, e.Long());
-                        break;
-
-                    case mongo::NumberInt:
-                        feature->put_new<mapnik::value_integer>(name, e.Int());
-                        break;
-
-                    default:
-                        std::cout << "ignored" << std::endl;
-                        break;
-                    }
-                }
+            if (itr_) {
+                if (!itr_->more())
+                    break;
+
+                mongo::BSONElement doc = itr_->next();
+                if (doc.type() != mongo::Object)
+                    continue;
+
+                feature = decoder_.decode(doc.embeddedObject(), feature_id_, stats_);
+            } else {
+                // more() does the getMore round trip once the batch is used up
+                double start = mapnik::time_now();
+                bool more = rs_->more();
+                stats_.server_ms += (mapnik::time_now() - start) * 1000.0;
+
+                if (!more)
+                    break;
+
+                feature = decoder_.decode(rs_->nextSafe(), feature_id_, stats_);
+            }
         } catch(mongo::DBException &de) {
-            std::string err_msg = "Mongodb Plugin: ";
-            err_msg += de.toString();
-            err_msg += "\n";
-            throw mapnik::datasource_exception(err_msg);
+            throw mapnik::datasource_exception(Connection::error_message(de));
         }
 
+        if (!feature)
+            continue;
+
         ++feature_id_;
         return feature;
     }
@@ -1,4 +1,3 @@
-
 /*****************************************************************************
  *
  * This file is part of Mapnik (c++ mapping toolkit)
@@ -36,6 +35,10 @@
 
 // boost
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "connection.hpp"
+#include "mongodb_decoder.hpp"
 
 using mapnik::Featureset;
 using mapnik::box2d;
@@ -44,15 +47,28 @@ using mapnik::transcoder;
 using mapnik::context_ptr;
 
 class mongodb_featureset : public mapnik::Featureset {
+    boost::shared_ptr<Connection> conn_; // keeps the connection borrowed while the cursor is alive
     boost::shared_ptr<mongo::DBClientCursor> rs_;
-    context_ptr ctx_;
-    boost::scoped_ptr<mapnik::transcoder> tr_;
+    mongo::BSONObj documents_; // inline aggregation result, used when there is no cursor
+    boost::scoped_ptr<mongo::BSONObjIterator> itr_;
+    mongodb_decoder decoder_;
     mapnik::value_integer feature_id_;
+    query_recorder_ptr recorder_;
+    query_stats stats_;
 
 public:
-    mongodb_featureset(const boost::shared_ptr<mongo::DBClientCursor> &rs,
+    mongodb_featureset(const boost::shared_ptr<Connection> &conn,
+                       const boost::shared_ptr<mongo::DBClientCursor> &rs,
+                       const context_ptr &ctx,
+                       const std::string &encoding,
+                       const mongodb_decoder::options &opts = mongodb_decoder::options(),
+                       const query_recorder_ptr &recorder = query_recorder_ptr());
+    mongodb_featureset(const boost::shared_ptr<Connection> &conn,
+                       const mongo::BSONObj &documents,
                        const context_ptr &ctx,
-                       const std::string &encoding);
+                       const std::string &encoding,
+                       const mongodb_decoder::options &opts = mongodb_decoder::options(),
+                       const query_recorder_ptr &recorder = query_recorder_ptr());
     ~mongodb_featureset();
 
     feature_ptr next();
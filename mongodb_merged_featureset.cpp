@@ -0,0 +1,160 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// mapnik
+#include <mapnik/timer.hpp>
+
+// boost
+#include <boost/bind.hpp>
+
+// stl
+#include <string>
+
+#include "mongodb_merged_featureset.hpp"
+
+mongodb_merged_featureset::mongodb_merged_featureset(const std::vector<boost::shared_ptr<Connection> > &conns,
+                                                     const std::vector<std::string> &queries,
+                                                     const mongo::BSONObj &fields,
+                                                     int batch_size,
+                                                     int max_time_ms,
+                                                     const context_ptr &ctx,
+                                                     const std::string &encoding,
+                                                     const mongodb_decoder::options &opts,
+                                                     size_t queue_size,
+                                                     const query_recorder_ptr &recorder)
+    : conns_(conns),
+      queries_(queries),
+      fields_(fields.getOwned()),
+      batch_size_(batch_size),
+      max_time_ms_(max_time_ms),
+      decoder_(ctx, encoding, opts),
+      documents_(queue_size),
+      feature_id_(0),
+      running_(conns.size()),
+      recorder_(recorder) {
+    for (size_t i = 0; i < conns_.size(); ++i)
+        workers_.create_thread(boost::bind(&mongodb_merged_featureset::fetch, this, i));
+}
+
+mongodb_merged_featureset::~mongodb_merged_featureset() {
+    documents_.cancel();
+    workers_.join_all();
+
+    if (recorder_)
+        recorder_->add(stats_);
+}
+
+void mongodb_merged_featureset::fail(const std::string &err_msg) {
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (error_.empty())
+            error_ = err_msg;
+    }
+
+    documents_.cancel();
+}
+
+void mongodb_merged_featureset::fetch(size_t index) {
+    query_stats stats;
+
+    try {
+        // queries are dealt round-robin over the connections
+        for (size_t q = index; q < queries_.size(); q += conns_.size()) {
+            double start = mapnik::time_now();
+            boost::shared_ptr<mongo::DBClientCursor> rs(conns_[index]->query(queries_[q], fields_, 0, 0,
+                                                                             batch_size_, max_time_ms_));
+            stats.server_ms += (mapnik::time_now() - start) * 1000.0;
+            bool accepted = true;
+
+            for (;;) {
+                start = mapnik::time_now();
+                bool more = rs->more();
+                stats.server_ms += (mapnik::time_now() - start) * 1000.0;
+
+                if (!more)
+                    break;
+
+                mongo::BSONObj bson = rs->nextSafe().getOwned();
+                ++stats.documents;
+                stats.bytes += bson.objsize();
+
+                if (!(accepted = documents_.push(bson)))
+                    break;
+            }
+
+            if (!accepted)
+                break;
+        }
+    } catch (mongo::DBException &de) {
+        fail(Connection::error_message(de));
+    } catch (mapnik::datasource_exception &e) {
+        fail(e.what());
+    }
+
+    if (recorder_)
+        recorder_->add(stats);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (--running_ == 0)
+        documents_.close();
+}
+
+feature_ptr mongodb_merged_featureset::next() {
+    mongo::BSONObj bson;
+
+    while (documents_.pop(bson)) {
+        mongo::BSONElement id = bson["_id"];
+
+        if (!id.eoo()) {
+            std::string key(id.value(), id.valuesize());
+            key += static_cast<char>(id.type());
+
+            if (!seen_.insert(key).second)
+                continue;
+        }
+
+        feature_ptr feature;
+
+        try {
+            // documents and bytes are counted by the fetch threads
+            query_stats decoded;
+            feature = decoder_.decode(bson, feature_id_, decoded);
+            decoded.documents = decoded.bytes = 0;
+            stats_ += decoded;
+        } catch(mongo::DBException &de) {
+            throw mapnik::datasource_exception(Connection::error_message(de));
+        }
+
+        if (!feature)
+            continue;
+
+        ++feature_id_;
+        return feature;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (!error_.empty())
+        throw mapnik::datasource_exception(error_);
+
+    return feature_ptr();
+}
@@ -0,0 +1,91 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_MERGED_FEATURESET_HPP
+#define MONGODB_MERGED_FEATURESET_HPP
+
+// mapnik
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature.hpp>
+
+// mongo
+#include <mongo/client/dbclientcursor.h>
+
+// boost
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+// stl
+#include <string>
+#include <vector>
+
+#include "connection.hpp"
+#include "mongodb_queue.hpp"
+#include "mongodb_decoder.hpp"
+#include "mongodb_stats.hpp"
+
+using mapnik::feature_ptr;
+using mapnik::context_ptr;
+
+// Runs several queries concurrently, one thread per borrowed connection,
+// and merges their results into one stream. Documents matched by more than
+// one query are emitted once, keyed by _id.
+class mongodb_merged_featureset : public mapnik::Featureset {
+    std::vector<boost::shared_ptr<Connection> > conns_;
+    std::vector<std::string> queries_;
+    mongo::BSONObj fields_;
+    int batch_size_;
+    int max_time_ms_;
+    mongodb_decoder decoder_;
+    bounded_queue<mongo::BSONObj> documents_;
+    boost::unordered_set<std::string> seen_;
+    mapnik::value_integer feature_id_;
+    boost::thread_group workers_;
+    boost::mutex mutex_;
+    size_t running_;
+    std::string error_;
+    query_recorder_ptr recorder_;
+    query_stats stats_; // consumer thread only
+
+    void fetch(size_t index);
+    void fail(const std::string &err_msg);
+
+public:
+    mongodb_merged_featureset(const std::vector<boost::shared_ptr<Connection> > &conns,
+                              const std::vector<std::string> &queries,
+                              const mongo::BSONObj &fields,
+                              int batch_size,
+                              int max_time_ms,
+                              const context_ptr &ctx,
+                              const std::string &encoding,
+                              const mongodb_decoder::options &opts,
+                              size_t queue_size,
+                              const query_recorder_ptr &recorder = query_recorder_ptr());
+    ~mongodb_merged_featureset();
+
+    feature_ptr next();
+};
+
+#endif // MONGODB_MERGED_FEATURESET_HPP
@@ -0,0 +1,100 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_METADATA_CACHE_HPP
+#define MONGODB_METADATA_CACHE_HPP
+
+// mapnik
+#include <mapnik/box2d.hpp>
+#include <mapnik/utils.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/attribute_descriptor.hpp>
+
+// boost
+#include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+
+// stl
+#include <string>
+#include <vector>
+#include <map>
+
+using mapnik::singleton;
+using mapnik::CreateStatic;
+
+// Attributes and geometry type inferred from a sample of documents.
+struct mongodb_schema {
+    std::vector<mapnik::attribute_descriptor> attributes;
+    boost::optional<mapnik::datasource::geometry_t> geometry_type;
+};
+
+// Collection properties that are expensive to compute, shared by all
+// datasources pointing at the same namespace.
+class mongodb_metadata_cache : public singleton<mongodb_metadata_cache, CreateStatic> {
+    friend class CreateStatic<mongodb_metadata_cache>;
+    typedef std::map<std::string, mapnik::box2d<double> > ExtentType;
+    typedef std::map<std::string, mongodb_schema> SchemaType;
+
+    ExtentType extents_;
+    SchemaType schemas_;
+    boost::mutex mutex_;
+
+public:
+    boost::optional<mongodb_schema> schema(const std::string &key) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        SchemaType::const_iterator itr = schemas_.find(key);
+        if (itr != schemas_.end())
+            return itr->second;
+
+        return boost::optional<mongodb_schema>();
+    }
+
+    void set_schema(const std::string &key, const mongodb_schema &schema) {
+        boost::mutex::scoped_lock lock(mutex_);
+        schemas_[key] = schema;
+    }
+
+    boost::optional<mapnik::box2d<double> > extent(const std::string &key) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        ExtentType::const_iterator itr = extents_.find(key);
+        if (itr != extents_.end())
+            return itr->second;
+
+        return boost::optional<mapnik::box2d<double> >();
+    }
+
+    void set_extent(const std::string &key, const mapnik::box2d<double> &ext) {
+        boost::mutex::scoped_lock lock(mutex_);
+        extents_[key] = ext;
+    }
+
+    mongodb_metadata_cache() {}
+
+private:
+    mongodb_metadata_cache(const mongodb_metadata_cache&);
+    mongodb_metadata_cache &operator=(const mongodb_metadata_cache);
+};
+
+#endif // MONGODB_METADATA_CACHE_HPP
@@ -0,0 +1,226 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// mapnik
+#include <mapnik/timer.hpp>
+
+// boost
+#include <boost/bind.hpp>
+
+// stl
+#include <string>
+
+#include "mongodb_prefetch_featureset.hpp"
+
+mongodb_prefetch_featureset::mongodb_prefetch_featureset(const boost::shared_ptr<Connection> &conn,
+                                                         const boost::shared_ptr<mongo::DBClientCursor> &rs,
+                                                         const context_ptr &ctx,
+                                                         const std::string &encoding,
+                                                         const mongodb_decoder::options &opts,
+                                                         size_t decode_threads,
+                                                         size_t queue_size,
+                                                         const query_recorder_ptr &recorder)
+    : conn_(conn),
+      rs_(rs),
+      max_time_ms_(0),
+      next_id_(0),
+      ctx_(ctx),
+      encoding_(encoding),
+      options_(opts),
+      documents_(queue_size),
+      features_(queue_size),
+      next_out_(0),
+      running_decoders_(0),
+      recorder_(recorder),
+      batch_done_(0) {
+    start(decode_threads);
+}
+
+mongodb_prefetch_featureset::mongodb_prefetch_featureset(const boost::shared_ptr<Connection> &conn,
+                                                         const std::string &query,
+                                                         const mongo::BSONObj &fields,
+                                                         int max_time_ms,
+                                                         const context_ptr &ctx,
+                                                         const std::string &encoding,
+                                                         const mongodb_decoder::options &opts,
+                                                         size_t decode_threads,
+                                                         size_t queue_size,
+                                                         const query_recorder_ptr &recorder)
+    : conn_(conn),
+      query_(query),
+      fields_(fields.getOwned()),
+      max_time_ms_(max_time_ms),
+      next_id_(0),
+      ctx_(ctx),
+      encoding_(encoding),
+      options_(opts),
+      documents_(queue_size),
+      features_(queue_size),
+      next_out_(0),
+      running_decoders_(0),
+      recorder_(recorder),
+      batch_done_(0) {
+    start(decode_threads);
+}
+
+void mongodb_prefetch_featureset::start(size_t decode_threads) {
+    running_decoders_ = decode_threads > 0 ? decode_threads : 1;
+
+    workers_.create_thread(boost::bind(&mongodb_prefetch_featureset::fetch, this));
+
+    for (size_t i = 0; i < running_decoders_; ++i)
+        workers_.create_thread(boost::bind(&mongodb_prefetch_featureset::decode, this));
+}
+
+mongodb_prefetch_featureset::~mongodb_prefetch_featureset() {
+    documents_.cancel();
+    features_.cancel();
+    workers_.join_all();
+}
+
+void mongodb_prefetch_featureset::fail(const std::string &err_msg) {
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (error_.empty())
+            error_ = err_msg;
+    }
+
+    documents_.cancel();
+    features_.close();
+}
+
+void mongodb_prefetch_featureset::fetch_batch(mongo::DBClientCursorBatchIterator &batch) {
+    // the time between batches is spent waiting on the server
+    fetch_stats_.server_ms += (mapnik::time_now() - batch_done_) * 1000.0;
+
+    while (batch.moreInCurrentBatch())
+        if (!documents_.push(std::make_pair(next_id_++, batch.nextObject().getOwned())))
+            throw cancelled();
+
+    batch_done_ = mapnik::time_now();
+}
+
+void mongodb_prefetch_featureset::fetch() {
+    try {
+        if (rs_) {
+            for (;;) {
+                double wait = mapnik::time_now();
+                bool more = rs_->more();
+                fetch_stats_.server_ms += (mapnik::time_now() - wait) * 1000.0;
+
+                // documents point into the cursor batch, which is freed on getMore
+                if (!more || !documents_.push(std::make_pair(next_id_++, rs_->nextSafe().getOwned())))
+                    break;
+            }
+        } else {
+            batch_done_ = mapnik::time_now();
+            conn_->exhaust(query_, fields_, max_time_ms_,
+                           boost::bind(&mongodb_prefetch_featureset::fetch_batch, this, _1));
+            fetch_stats_.server_ms += (mapnik::time_now() - batch_done_) * 1000.0;
+        }
+    } catch (cancelled &) {
+        // the rest of the exhaust stream is still on the wire
+        conn_->discard();
+    } catch (mongo::DBException &de) {
+        fail(Connection::error_message(de));
+    } catch (mapnik::datasource_exception &e) {
+        if (!rs_)
+            conn_->discard();
+        fail(e.what());
+    } catch (std::exception &e) {
+        // anything else escaping the thread would terminate the process
+        if (!rs_)
+            conn_->discard();
+        fail(std::string("Mongodb Plugin: ") + e.what() + "\n");
+    }
+
+    if (recorder_)
+        recorder_->add(fetch_stats_);
+
+    documents_.close();
+}
+
+void mongodb_prefetch_featureset::decode() {
+    try {
+        // the context is populated up front, decoders only read it
+        mongodb_decoder::options opts = options_;
+        opts.extend_context = false;
+        mongodb_decoder decoder(ctx_, encoding_, opts);
+        document_type doc;
+        query_stats stats;
+
+        while (documents_.pop(doc)) {
+            feature_ptr feature = decoder.decode(doc.second, doc.first, stats);
+
+            // dropped documents are passed on too, next() waits for every id
+            if (!features_.push(std::make_pair(doc.first, feature)))
+                break;
+        }
+
+        if (recorder_)
+            recorder_->add(stats);
+    } catch (mongo::DBException &de) {
+        fail(Connection::error_message(de));
+    } catch (std::exception &e) {
+        fail(std::string("Mongodb Plugin: ") + e.what() + "\n");
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (--running_decoders_ == 0)
+        features_.close();
+}
+
+feature_ptr mongodb_prefetch_featureset::next() {
+    decoded_type decoded;
+
+    // decode threads finish out of order, hold features back until
+    // everything before them in the cursor has been handed out
+    for (;;) {
+        std::map<mapnik::value_integer, feature_ptr>::iterator itr = reordered_.find(next_out_);
+        if (itr != reordered_.end()) {
+            feature_ptr feature = itr->second;
+            reordered_.erase(itr);
+            ++next_out_;
+            if (feature)
+                return feature;
+            continue;
+        }
+
+        if (!features_.pop(decoded))
+            break;
+
+        if (decoded.first != next_out_)
+            reordered_.insert(decoded);
+        else {
+            ++next_out_;
+            if (decoded.second)
+                return decoded.second;
+        }
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (!error_.empty())
+        throw mapnik::datasource_exception(error_);
+
+    return feature_ptr();
+}
@@ -0,0 +1,117 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_PREFETCH_FEATURESET_HPP
+#define MONGODB_PREFETCH_FEATURESET_HPP
+
+// mapnik
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature.hpp>
+
+// mongo
+#include <mongo/client/dbclientcursor.h>
+
+// boost
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+// stl
+#include <string>
+#include <utility>
+#include <map>
+
+#include "connection.hpp"
+#include "mongodb_queue.hpp"
+#include "mongodb_decoder.hpp"
+#include "mongodb_stats.hpp"
+
+using mapnik::feature_ptr;
+using mapnik::context_ptr;
+
+// Pipelined featureset: a fetch thread drains the cursor (issuing getMore
+// while earlier batches are still being consumed) or an exhaust stream and
+// decode threads turn the documents into features, so the renderer only
+// pops finished features. Features are handed out in cursor order whatever
+// the number of decode threads, so painter order and label placement
+// don't change between renders.
+class mongodb_prefetch_featureset : public mapnik::Featureset {
+    typedef std::pair<mapnik::value_integer, mongo::BSONObj> document_type;
+    // a null feature stands for a document the decoder dropped
+    typedef std::pair<mapnik::value_integer, feature_ptr> decoded_type;
+
+    struct cancelled {};
+
+    boost::shared_ptr<Connection> conn_;
+    boost::shared_ptr<mongo::DBClientCursor> rs_;
+    std::string query_;
+    mongo::BSONObj fields_;
+    int max_time_ms_;
+    mapnik::value_integer next_id_;
+    context_ptr ctx_;
+    std::string encoding_;
+    mongodb_decoder::options options_;
+    bounded_queue<document_type> documents_;
+    bounded_queue<decoded_type> features_;
+    std::map<mapnik::value_integer, feature_ptr> reordered_; // consumer only
+    mapnik::value_integer next_out_;
+    boost::thread_group workers_;
+    boost::mutex mutex_;
+    size_t running_decoders_;
+    std::string error_;
+    query_recorder_ptr recorder_;
+    query_stats fetch_stats_; // fetch thread only
+    double batch_done_;
+
+    void start(size_t decode_threads);
+    void fetch();
+    void fetch_batch(mongo::DBClientCursorBatchIterator &batch);
+    void decode();
+    void fail(const std::string &err_msg);
+
+public:
+    mongodb_prefetch_featureset(const boost::shared_ptr<Connection> &conn,
+                                const boost::shared_ptr<mongo::DBClientCursor> &rs,
+                                const context_ptr &ctx,
+                                const std::string &encoding,
+                                const mongodb_decoder::options &opts,
+                                size_t decode_threads,
+                                size_t queue_size,
+                                const query_recorder_ptr &recorder = query_recorder_ptr());
+    // exhaust mode: runs the query on the fetch thread
+    mongodb_prefetch_featureset(const boost::shared_ptr<Connection> &conn,
+                                const std::string &query,
+                                const mongo::BSONObj &fields,
+                                int max_time_ms,
+                                const context_ptr &ctx,
+                                const std::string &encoding,
+                                const mongodb_decoder::options &opts,
+                                size_t decode_threads,
+                                size_t queue_size,
+                                const query_recorder_ptr &recorder = query_recorder_ptr());
+    ~mongodb_prefetch_featureset();
+
+    feature_ptr next();
+};
+
+#endif // MONGODB_PREFETCH_FEATURESET_HPP
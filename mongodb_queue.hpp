@@ -0,0 +1,95 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_QUEUE_HPP
+#define MONGODB_QUEUE_HPP
+
+// boost
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// stl
+#include <deque>
+
+// Blocking FIFO of bounded capacity shared by producer and consumer threads.
+// After close() pushes are rejected and pops drain what is left.
+template <typename T>
+class bounded_queue : private boost::noncopyable {
+    std::deque<T> items_;
+    size_t capacity_;
+    bool closed_;
+    boost::mutex mutex_;
+    boost::condition_variable not_empty_;
+    boost::condition_variable not_full_;
+
+public:
+    explicit bounded_queue(size_t capacity)
+        : capacity_(capacity > 0 ? capacity : 1), closed_(false) {}
+
+    bool push(const T &item) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        while (!closed_ && items_.size() >= capacity_)
+            not_full_.wait(lock);
+
+        if (closed_)
+            return false;
+
+        items_.push_back(item);
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool pop(T &item) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        while (!closed_ && items_.empty())
+            not_empty_.wait(lock);
+
+        if (items_.empty())
+            return false;
+
+        item = items_.front();
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        boost::mutex::scoped_lock lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    void cancel() {
+        boost::mutex::scoped_lock lock(mutex_);
+        closed_ = true;
+        items_.clear();
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+};
+
+#endif // MONGODB_QUEUE_HPP
@@ -0,0 +1,81 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// mapnik
+#include <mapnik/debug.hpp>
+
+// boost
+#include <boost/make_shared.hpp>
+
+#include "mongodb_stats.hpp"
+
+mongodb_stats_ptr mongodb_stats_registry::get(const std::string &ns) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    mongodb_stats_ptr &stats = stats_[ns];
+    if (!stats)
+        stats = boost::make_shared<mongodb_stats>();
+
+    return stats;
+}
+
+std::map<std::string, query_stats> mongodb_stats_registry::totals() {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<std::string, query_stats> result;
+
+    for (ContType::const_iterator itr = stats_.begin(); itr != stats_.end(); ++itr)
+        result[itr->first] = itr->second->totals();
+
+    return result;
+}
+
+query_recorder::query_recorder(const std::string &ns, const mongodb_stats_ptr &datasource)
+    : ns_(ns),
+      datasource_(datasource),
+      namespace_(mongodb_stats_registry::instance().get(ns)) {
+    stats_.queries = 1;
+}
+
+query_recorder::~query_recorder() {
+    if (datasource_)
+        datasource_->add(stats_);
+    namespace_->add(stats_);
+
+    MAPNIK_LOG_DEBUG(mongodb) << "mongodb_featureset: " << ns_
+                              << " pool_wait=" << stats_.pool_wait_ms << "ms"
+                              << " server=" << stats_.server_ms << "ms"
+                              << " decode=" << stats_.decode_ms << "ms"
+                              << " bytes=" << stats_.bytes
+                              << " documents=" << stats_.documents
+                              << " features=" << stats_.features
+                              << " vertices=" << stats_.vertices;
+}
+
+void query_recorder::add(const query_stats &stats) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    // queries is counted once, by the constructor
+    boost::uint64_t queries = stats_.queries;
+    stats_ += stats;
+    stats_.queries = queries;
+}
@@ -0,0 +1,134 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MONGODB_STATS_HPP
+#define MONGODB_STATS_HPP
+
+// mapnik
+#include <mapnik/utils.hpp>
+
+// boost
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+// stl
+#include <string>
+#include <map>
+
+using mapnik::singleton;
+using mapnik::CreateStatic;
+
+// Counters and timers of one or more queries. Times are in milliseconds,
+// bytes are the sizes of the BSON documents received.
+struct query_stats {
+    boost::uint64_t queries;
+    double pool_wait_ms;
+    double server_ms;
+    double decode_ms;
+    boost::uint64_t bytes;
+    boost::uint64_t documents;
+    boost::uint64_t features;
+    boost::uint64_t vertices;
+
+    query_stats()
+        : queries(0), pool_wait_ms(0), server_ms(0), decode_ms(0),
+          bytes(0), documents(0), features(0), vertices(0) {}
+
+    query_stats &operator+=(const query_stats &rhs) {
+        queries += rhs.queries;
+        pool_wait_ms += rhs.pool_wait_ms;
+        server_ms += rhs.server_ms;
+        decode_ms += rhs.decode_ms;
+        bytes += rhs.bytes;
+        documents += rhs.documents;
+        features += rhs.features;
+        vertices += rhs.vertices;
+        return *this;
+    }
+};
+
+// Thread-safe running totals.
+class mongodb_stats : private boost::noncopyable {
+    query_stats totals_;
+    mutable boost::mutex mutex_;
+
+public:
+    void add(const query_stats &stats) {
+        boost::mutex::scoped_lock lock(mutex_);
+        totals_ += stats;
+    }
+
+    query_stats totals() const {
+        boost::mutex::scoped_lock lock(mutex_);
+        return totals_;
+    }
+
+    void reset() {
+        boost::mutex::scoped_lock lock(mutex_);
+        totals_ = query_stats();
+    }
+};
+
+typedef boost::shared_ptr<mongodb_stats> mongodb_stats_ptr;
+
+// Totals per namespace ("dbname.collection") over all datasources.
+class mongodb_stats_registry : public singleton<mongodb_stats_registry, CreateStatic> {
+    friend class CreateStatic<mongodb_stats_registry>;
+    typedef std::map<std::string, mongodb_stats_ptr> ContType;
+
+    ContType stats_;
+    boost::mutex mutex_;
+
+public:
+    mongodb_stats_ptr get(const std::string &ns);
+    std::map<std::string, query_stats> totals();
+
+    mongodb_stats_registry() {}
+
+private:
+    mongodb_stats_registry(const mongodb_stats_registry&);
+    mongodb_stats_registry &operator=(const mongodb_stats_registry);
+};
+
+// Collects the statistics of one query. Featuresets add what they measured
+// (threads add their own share once), and on destruction the result goes to
+// the datasource and namespace totals and to the mongodb debug log.
+class query_recorder : private boost::noncopyable {
+    std::string ns_;
+    query_stats stats_;
+    mongodb_stats_ptr datasource_;
+    mongodb_stats_ptr namespace_;
+    boost::mutex mutex_;
+
+public:
+    query_recorder(const std::string &ns, const mongodb_stats_ptr &datasource);
+    ~query_recorder();
+
+    void add(const query_stats &stats);
+};
+
+typedef boost::shared_ptr<query_recorder> query_recorder_ptr;
+
+#endif // MONGODB_STATS_HPP
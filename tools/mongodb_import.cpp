@@ -0,0 +1,571 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *               2013 Oleksandr Novychenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// Bulk loader of shapefiles into a collection laid out for the mongodb
+// plugin: GeoJSON "geometry" and "properties", optionally with
+// pre-generalized geometry levels, per-document bbox fields and packed
+// binary geometry. Documents go in unordered batch inserts, each batch
+// acknowledged with getLastError, and the indexes are built once the data
+// is in.
+//
+//     ./tools/mongodb_import [options] <shapefile> <collection>
+
+// mapnik
+#include <mapnik/datasource.hpp>
+#include <mapnik/datasource_cache.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/feature_kv_iterator.hpp>
+#include <mapnik/geometry.hpp>
+#include <mapnik/vertex.hpp>
+#include <mapnik/query.hpp>
+#include <mapnik/params.hpp>
+#include <mapnik/value.hpp>
+#include <mapnik/timer.hpp>
+
+// mongo
+#include <mongo/client/dbclient.h>
+
+// boost
+#include <boost/cstdint.hpp>
+#include <boost/variant.hpp>
+#include <boost/algorithm/string.hpp>
+
+// stl
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <cstdlib>
+
+#include "mongodb_converter.hpp"
+
+#ifndef MAPNIK_INPUT_PLUGINS
+#define MAPNIK_INPUT_PLUGINS "/usr/local/lib/mapnik/input"
+#endif
+
+namespace {
+
+typedef std::pair<double, double> position;
+typedef std::vector<position> path;
+
+// one GeoJSON Point, LineString or Polygon (exterior ring first)
+struct part {
+    mapnik::eGeomType type;
+    std::vector<path> rings;
+};
+
+struct options {
+    std::string host;
+    std::string dbname;
+    std::string plugins;
+    size_t batch_size;
+    std::vector<std::pair<std::string, double> > lod; // field -> tolerance
+    bool bbox;
+    std::string packed;
+    bool hilbert;
+    bool drop;
+    bool index;
+
+    options()
+        : host("localhost:27017"), dbname("gis"), plugins(MAPNIK_INPUT_PLUGINS),
+          batch_size(1000), bbox(false), hilbert(false), drop(false), index(true) {}
+};
+
+void usage() {
+    std::cerr << "usage: mongodb_import [options] <shapefile> <collection>\n"
+              << "  --host HOST[:PORT]   server to load into [localhost:27017]\n"
+              << "  --dbname NAME        database [gis]\n"
+              << "  --plugins DIR        mapnik input plugins [" MAPNIK_INPUT_PLUGINS "]\n"
+              << "  --batch N            documents per insert batch [1000]\n"
+              << "  --lod FIELD:TOL,...  write generalized GeoJSON levels, TOL in degrees\n"
+              << "  --bbox               write bbox.minx/miny/maxx/maxy fields and index them\n"
+              << "  --packed FIELD       write the geometry packed into a BinData field\n"
+              << "  --hilbert            insert in Hilbert curve order (holds the layer in memory)\n"
+              << "  --drop               drop the collection first\n"
+              << "  --no-index           don't build the 2dsphere index\n";
+}
+
+double signed_area(const path &ring) {
+    double area = 0;
+
+    for (size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++)
+        area += (ring[j].first - ring[i].first) * (ring[j].second + ring[i].second);
+
+    return area / 2;
+}
+
+// Splits mapnik paths into GeoJSON parts. Mapnik keeps every ring of a
+// (multi)polygon in one path; rings wound like the first one start a new
+// polygon, the others are its holes.
+void split_geometry(const mapnik::geometry_type &geom, std::vector<part> &parts) {
+    std::vector<path> paths;
+    double x, y;
+
+    for (unsigned i = 0; i < geom.size(); ++i) {
+        unsigned cmd = geom.vertex(i, &x, &y);
+
+        if (cmd == mapnik::SEG_MOVETO || paths.empty())
+            paths.push_back(path());
+        if (cmd == mapnik::SEG_MOVETO || cmd == mapnik::SEG_LINETO)
+            paths.back().push_back(position(x, y));
+    }
+
+    if (geom.type() == mapnik::Point) {
+        for (std::vector<path>::const_iterator itr = paths.begin(); itr != paths.end(); ++itr)
+            for (path::const_iterator p = itr->begin(); p != itr->end(); ++p) {
+                part pt;
+                pt.type = mapnik::Point;
+                pt.rings.push_back(path(1, *p));
+                parts.push_back(pt);
+            }
+    } else if (geom.type() == mapnik::LineString) {
+        for (std::vector<path>::const_iterator itr = paths.begin(); itr != paths.end(); ++itr)
+            if (itr->size() >= 2) {
+                part line;
+                line.type = mapnik::LineString;
+                line.rings.push_back(*itr);
+                parts.push_back(line);
+            }
+    } else if (geom.type() == mapnik::Polygon) {
+        bool outer_sign = false, first = true;
+
+        for (std::vector<path>::iterator itr = paths.begin(); itr != paths.end(); ++itr) {
+            if (!itr->empty() && itr->front() != itr->back())
+                itr->push_back(itr->front());
+            if (itr->size() < 4)
+                continue;
+
+            bool sign = signed_area(*itr) > 0;
+            if (first) {
+                outer_sign = sign;
+                first = false;
+            }
+
+            if (sign == outer_sign || parts.empty()) {
+                part poly;
+                poly.type = mapnik::Polygon;
+                parts.push_back(poly);
+            }
+            parts.back().rings.push_back(*itr);
+        }
+    }
+}
+
+double segment_distance(const position &p, const position &a, const position &b) {
+    double dx = b.first - a.first, dy = b.second - a.second;
+    double len = dx * dx + dy * dy;
+    double t = len > 0 ? ((p.first - a.first) * dx + (p.second - a.second) * dy) / len : 0;
+    t = std::max(0.0, std::min(1.0, t));
+
+    double ex = a.first + t * dx - p.first, ey = a.second + t * dy - p.second;
+    return std::sqrt(ex * ex + ey * ey);
+}
+
+// Douglas-Peucker
+path simplify(const path &line, double tolerance) {
+    if (line.size() <= 2)
+        return line;
+
+    std::vector<bool> keep(line.size(), false);
+    std::vector<std::pair<size_t, size_t> > stack(1, std::make_pair(0, line.size() - 1));
+    keep.front() = keep.back() = true;
+
+    while (!stack.empty()) {
+        std::pair<size_t, size_t> span = stack.back();
+        stack.pop_back();
+
+        double max_dist = 0;
+        size_t index = span.first;
+        for (size_t i = span.first + 1; i < span.second; ++i) {
+            double d = segment_distance(line[i], line[span.first], line[span.second]);
+            if (d > max_dist) {
+                max_dist = d;
+                index = i;
+            }
+        }
+
+        if (max_dist > tolerance) {
+            keep[index] = true;
+            stack.push_back(std::make_pair(span.first, index));
+            stack.push_back(std::make_pair(index, span.second));
+        }
+    }
+
+    path result;
+    for (size_t i = 0; i < line.size(); ++i)
+        if (keep[i])
+            result.push_back(line[i]);
+
+    return result;
+}
+
+part simplify(const part &p, double tolerance) {
+    if (p.type == mapnik::Point)
+        return p;
+
+    part result;
+    result.type = p.type;
+
+    for (std::vector<path>::const_iterator itr = p.rings.begin(); itr != p.rings.end(); ++itr) {
+        path ring = simplify(*itr, tolerance);
+
+        // a collapsed exterior stays as is so the feature remains visible,
+        // collapsed holes are dropped
+        if (p.type == mapnik::Polygon && ring.size() < 4)
+            ring = itr == p.rings.begin() ? *itr : path();
+
+        if (!ring.empty())
+            result.rings.push_back(ring);
+    }
+
+    return result;
+}
+
+mongo::BSONArray positions(const path &ring) {
+    mongo::BSONArrayBuilder coords;
+
+    for (path::const_iterator itr = ring.begin(); itr != ring.end(); ++itr)
+        coords.append(BSON_ARRAY(itr->first << itr->second));
+
+    return coords.arr();
+}
+
+mongo::BSONObj geojson(const part &p) {
+    mongo::BSONObjBuilder geom;
+
+    if (p.type == mapnik::Point) {
+        geom.append("type", "Point");
+        geom.append("coordinates", BSON_ARRAY(p.rings[0][0].first << p.rings[0][0].second));
+    } else if (p.type == mapnik::LineString) {
+        geom.append("type", "LineString");
+        geom.append("coordinates", positions(p.rings[0]));
+    } else {
+        mongo::BSONArrayBuilder rings;
+        for (std::vector<path>::const_iterator itr = p.rings.begin(); itr != p.rings.end(); ++itr)
+            rings.append(positions(*itr));
+
+        geom.append("type", "Polygon");
+        geom.append("coordinates", rings.arr());
+    }
+
+    return geom.obj();
+}
+
+mapnik::box2d<double> envelope(const part &p) {
+    mapnik::box2d<double> ext(p.rings[0][0].first, p.rings[0][0].second,
+                              p.rings[0][0].first, p.rings[0][0].second);
+
+    for (std::vector<path>::const_iterator itr = p.rings.begin(); itr != p.rings.end(); ++itr)
+        for (path::const_iterator pos = itr->begin(); pos != itr->end(); ++pos)
+            ext.expand_to_include(pos->first, pos->second);
+
+    return ext;
+}
+
+class append_value : public boost::static_visitor<> {
+    mongo::BSONObjBuilder &builder_;
+    const std::string &name_;
+
+public:
+    append_value(mongo::BSONObjBuilder &builder, const std::string &name)
+        : builder_(builder), name_(name) {}
+
+    void operator()(const mapnik::value_null &) const {
+        builder_.appendNull(name_);
+    }
+
+    void operator()(mapnik::value_bool value) const {
+        builder_.append(name_, value);
+    }
+
+    void operator()(mapnik::value_integer value) const {
+        builder_.append(name_, static_cast<long long>(value));
+    }
+
+    void operator()(mapnik::value_double value) const {
+        builder_.append(name_, value);
+    }
+
+    void operator()(const mapnik::value_unicode_string &value) const {
+        std::string utf8;
+        value.toUTF8String(utf8);
+        builder_.append(name_, utf8);
+    }
+};
+
+// position along a Hilbert curve of order 16 over ext
+boost::uint32_t hilbert_key(const mapnik::box2d<double> &ext, double x, double y) {
+    const boost::uint32_t n = 1 << 16;
+    double fx = ext.width() > 0 ? (x - ext.minx()) / ext.width() : 0;
+    double fy = ext.height() > 0 ? (y - ext.miny()) / ext.height() : 0;
+    boost::uint32_t hx = static_cast<boost::uint32_t>(std::max(0.0, std::min(fx * (n - 1), n - 1.0)));
+    boost::uint32_t hy = static_cast<boost::uint32_t>(std::max(0.0, std::min(fy * (n - 1), n - 1.0)));
+    boost::uint32_t d = 0;
+
+    for (boost::uint32_t s = n / 2; s > 0; s /= 2) {
+        boost::uint32_t rx = (hx & s) > 0;
+        boost::uint32_t ry = (hy & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        if (ry == 0) {
+            if (rx == 1) {
+                hx = n - 1 - hx;
+                hy = n - 1 - hy;
+            }
+            std::swap(hx, hy);
+        }
+    }
+
+    return d;
+}
+
+struct sort_by_key {
+    bool operator()(const std::pair<boost::uint32_t, mongo::BSONObj> &a,
+                    const std::pair<boost::uint32_t, mongo::BSONObj> &b) const {
+        return a.first < b.first;
+    }
+};
+
+mongo::BSONObj make_document(const part &p, const mongo::BSONObj &properties, const options &opts) {
+    mongo::BSONObjBuilder doc;
+    mongo::BSONObj geometry = geojson(p);
+
+    doc.append("geometry", geometry);
+    doc.append("properties", properties);
+
+    if (opts.bbox) {
+        mapnik::box2d<double> ext = envelope(p);
+        doc.append("bbox", BSON("minx" << ext.minx() << "miny" << ext.miny() <<
+                                "maxx" << ext.maxx() << "maxy" << ext.maxy()));
+    }
+
+    for (std::vector<std::pair<std::string, double> >::const_iterator itr = opts.lod.begin(); itr != opts.lod.end(); ++itr)
+        doc.append(itr->first, geojson(simplify(p, itr->second)));
+
+    if (!opts.packed.empty()) {
+        mongo::BSONObj wrapper = BSON("g" << geometry);
+        std::string packed;
+
+        if (mongodb_converter::encode_packed(wrapper["g"], packed))
+            doc.appendBinData(opts.packed, packed.size(),
+                              static_cast<mongo::BinDataType>(mongodb_converter::packed_subtype), packed.data());
+    }
+
+    return doc.obj();
+}
+
+class loader {
+    mongo::DBClientConnection &conn_;
+    std::string ns_;
+    size_t batch_size_;
+    std::vector<mongo::BSONObj> batch_;
+    size_t inserted_;
+    size_t errors_; // failed batches
+    size_t failed_; // documents in failed batches, some may have gone in
+
+public:
+    loader(mongo::DBClientConnection &conn, const std::string &ns, size_t batch_size)
+        : conn_(conn), ns_(ns), batch_size_(batch_size), inserted_(0), errors_(0), failed_(0) {
+        batch_.reserve(batch_size_);
+    }
+
+    void add(const mongo::BSONObj &doc) {
+        batch_.push_back(doc);
+        if (batch_.size() >= batch_size_)
+            flush();
+    }
+
+    void flush() {
+        if (batch_.empty())
+            return;
+
+        // one acknowledged round trip per batch rather than per document;
+        // getLastError only reports the last failure of a batch, not how
+        // many documents failed, so a failed batch isn't counted at all
+        conn_.insert(ns_, batch_, mongo::InsertOption_ContinueOnError);
+        std::string err = conn_.getLastError();
+        if (err.empty())
+            inserted_ += batch_.size();
+        else {
+            std::cerr << "insert error: " << err << std::endl;
+            ++errors_;
+            failed_ += batch_.size();
+        }
+
+        batch_.clear();
+    }
+
+    size_t inserted() const { return inserted_; }
+    size_t errors() const { return errors_; }
+    size_t failed() const { return failed_; }
+};
+
+bool parse_args(int argc, char **argv, options &opts, std::vector<std::string> &args) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--host" && has_value)
+            opts.host = argv[++i];
+        else if (arg == "--dbname" && has_value)
+            opts.dbname = argv[++i];
+        else if (arg == "--plugins" && has_value)
+            opts.plugins = argv[++i];
+        else if (arg == "--batch" && has_value)
+            opts.batch_size = std::max(std::atoi(argv[++i]), 1);
+        else if (arg == "--lod" && has_value) {
+            std::vector<std::string> levels;
+            std::string value = argv[++i];
+            boost::split(levels, value, boost::is_any_of(","));
+
+            for (std::vector<std::string>::const_iterator itr = levels.begin(); itr != levels.end(); ++itr) {
+                std::string::size_type sep = itr->find(':');
+                if (sep == std::string::npos)
+                    return false;
+                opts.lod.push_back(std::make_pair(boost::trim_copy(itr->substr(0, sep)),
+                                                  std::atof(itr->c_str() + sep + 1)));
+            }
+        } else if (arg == "--bbox")
+            opts.bbox = true;
+        else if (arg == "--packed" && has_value)
+            opts.packed = argv[++i];
+        else if (arg == "--hilbert")
+            opts.hilbert = true;
+        else if (arg == "--drop")
+            opts.drop = true;
+        else if (arg == "--no-index")
+            opts.index = false;
+        else if (!arg.empty() && arg[0] == '-')
+            return false;
+        else
+            args.push_back(arg);
+    }
+
+    return args.size() == 2;
+}
+
+bool ensure_index(mongo::DBClientConnection &conn, const std::string &ns, const mongo::BSONObj &keys) {
+    conn.ensureIndex(ns, keys);
+
+    std::string err = conn.getLastError();
+    if (!err.empty()) {
+        std::cerr << "index error on " << keys.toString() << ": " << err << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    options opts;
+    std::vector<std::string> args;
+
+    if (!parse_args(argc, argv, opts, args)) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    std::string ns = opts.dbname + "." + args[1];
+
+    try {
+        mapnik::datasource_cache::instance().register_datasources(opts.plugins);
+
+        mapnik::parameters params;
+        params["type"] = "shape";
+        params["file"] = args[0];
+        mapnik::datasource_ptr ds = mapnik::datasource_cache::instance().create(params);
+
+        mapnik::box2d<double> extent = ds->envelope();
+        mapnik::query q(extent);
+        std::vector<mapnik::attribute_descriptor> attrs = ds->get_descriptor().get_descriptors();
+        for (std::vector<mapnik::attribute_descriptor>::const_iterator itr = attrs.begin(); itr != attrs.end(); ++itr)
+            q.add_property_name(itr->get_name());
+
+        mongo::DBClientConnection conn;
+        conn.connect(opts.host);
+
+        if (opts.drop)
+            conn.dropCollection(ns);
+
+        double start = mapnik::time_now();
+        loader load(conn, ns, opts.batch_size);
+        std::vector<std::pair<boost::uint32_t, mongo::BSONObj> > sorted;
+
+        mapnik::featureset_ptr fs = ds->features(q);
+        for (mapnik::feature_ptr feature = fs ? fs->next() : mapnik::feature_ptr(); feature; feature = fs->next()) {
+            mongo::BSONObjBuilder properties;
+            for (mapnik::feature_kv_iterator itr = feature->begin(); itr != feature->end(); ++itr)
+                boost::apply_visitor(append_value(properties, boost::get<0>(*itr)), boost::get<1>(*itr).base());
+            mongo::BSONObj props = properties.obj();
+
+            std::vector<part> parts;
+            for (unsigned i = 0; i < feature->num_geometries(); ++i)
+                split_geometry(feature->get_geometry(i), parts);
+
+            for (std::vector<part>::const_iterator itr = parts.begin(); itr != parts.end(); ++itr) {
+                mongo::BSONObj doc = make_document(*itr, props, opts);
+
+                if (opts.hilbert) {
+                    mapnik::coord2d c = envelope(*itr).center();
+                    sorted.push_back(std::make_pair(hilbert_key(extent, c.x, c.y), doc));
+                } else
+                    load.add(doc);
+            }
+        }
+
+        if (opts.hilbert) {
+            std::stable_sort(sorted.begin(), sorted.end(), sort_by_key());
+            for (size_t i = 0; i < sorted.size(); ++i)
+                load.add(sorted[i].second);
+        }
+        load.flush();
+
+        double loaded = mapnik::time_now();
+        std::cout << load.inserted() << " documents loaded into " << ns << " in "
+                  << loaded - start << " s" << std::endl;
+        if (load.errors() > 0)
+            std::cerr << load.errors() << " batches failed, holding " << load.failed()
+                      << " documents of which some may have been inserted" << std::endl;
+
+        bool ok = load.errors() == 0;
+        if (opts.index) {
+            ok &= ensure_index(conn, ns, BSON("geometry" << "2dsphere"));
+            if (opts.bbox)
+                ok &= ensure_index(conn, ns, BSON("bbox.minx" << 1 << "bbox.miny" << 1 <<
+                                                  "bbox.maxx" << 1 << "bbox.maxy" << 1));
+            std::cout << "indexes built in " << mapnik::time_now() - loaded << " s" << std::endl;
+        }
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    } catch (mongo::DBException &de) {
+        std::cerr << "mongodb error: " << de.toString() << std::endl;
+    } catch (std::exception &e) {
+        std::cerr << "error: " << e.what() << std::endl;
+    }
+
+    return EXIT_FAILURE;
+}